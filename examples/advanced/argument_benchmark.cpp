@@ -0,0 +1,98 @@
+// Description: Measures typed argument parsing against the std::stoi / std::stoul path: time per call.
+// "stoi" copies the argument into a std::string and converts it, throwing on bad input.
+// "typed" is com.arg<int>() / com.get(), which parses the view in place and reports errors as a status.
+// Results are printed on Serial and, once a host connects, on the benchmark console.
+
+#include <Arduino.h>
+#include <ArcticClient.h>
+
+ArcticClient arctic_client;
+ArcticTerminal bench_console("Benchmark Console");
+
+#define ITERATIONS 10000
+
+String results;
+volatile uint32_t sink; // keeps the compiler from removing the loops
+
+void report(const char* name, uint32_t time) {
+	char line[96];
+	snprintf(line, sizeof(line), "%-28s %6lu ns/call\n", name, (unsigned long)((uint64_t)time * 1000 / ITERATIONS));
+	results += line;
+}
+
+void run_benchmark() {
+	ArcticCommand count("ping -c 25");
+	ArcticCommand setup("ARCTIC_COMMAND_OTA_SETUP -s 1310720 -md5 0123456789abcdef0123456789abcdef");
+	ArcticCommand bad("ping -c abc");
+	ArcticCommand not_a_number("ping -i nan");
+
+	// Sanity check before timing: bad input must be reported, not parsed
+	int value = 0;
+	float interval = 0;
+	if (bad.get("-c", value) != ARCTIC_ARG_INVALID) results += "typed -c accepted \"abc\"\n";
+	if (not_a_number.get("-i", interval) != ARCTIC_ARG_INVALID) results += "typed -i accepted \"nan\"\n";
+	if (not_a_number.get("-i", interval, 0.0f, 10.0f) != ARCTIC_ARG_INVALID) results += "typed -i range accepted \"nan\"\n";
+
+	uint32_t start = micros();
+	for (int i = 0; i < ITERATIONS; i++) {
+		sink = std::stoi(count.arg("-c"));
+	}
+	report("stoi -c", micros() - start);
+
+	start = micros();
+	for (int i = 0; i < ITERATIONS; i++) {
+		sink = count.arg("-c", 0);
+	}
+	report("typed -c", micros() - start);
+
+	// ArcticOTA setup size, before and after
+	start = micros();
+	for (int i = 0; i < ITERATIONS; i++) {
+		std::string size_str = setup.arg("-s");
+		sink = std::stoul(size_str);
+	}
+	report("stoul -s", micros() - start);
+
+	start = micros();
+	for (int i = 0; i < ITERATIONS; i++) {
+		uint32_t size = 0;
+		setup.get("-s", size);
+		sink = size;
+	}
+	report("typed -s", micros() - start);
+
+	// Bad input: std::stoi throws, the typed path returns ARCTIC_ARG_INVALID
+	start = micros();
+	for (int i = 0; i < ITERATIONS; i++) {
+		try {
+			sink = std::stoi(bad.arg("-c"));
+		} catch (...) {
+			sink = 0;
+		}
+	}
+	report("stoi invalid (exception)", micros() - start);
+
+	start = micros();
+	for (int i = 0; i < ITERATIONS; i++) {
+		int value = 0;
+		sink = bad.get("-c", value);
+	}
+	report("typed invalid (status)", micros() - start);
+
+	Serial.print(results);
+}
+
+void setup() {
+	Serial.begin(115200);
+
+	arctic_client.begin();
+	arctic_client.add(bench_console);
+	arctic_client.start();
+
+	run_benchmark();
+}
+
+void loop() {
+	bench_console.printf("%s", results.c_str());
+	delay(5000);
+}
\ No newline at end of file
@@ -0,0 +1,90 @@
+// Description: Measures the console compression on typical log output: compression ratio and CPU time per KB.
+// The ratio is the effective throughput gain of compressed mode, the link carries that many times more text.
+// Results are printed on Serial and, once a host connects, on the benchmark console.
+
+#include <Arduino.h>
+#include <ArcticClient.h>
+
+ArcticClient arctic_client;
+ArcticTerminal bench_console("Benchmark Console");
+
+ArcticLZEncoder encoder;
+ArcticLZDecoder decoder;
+
+#define CORPUS_SIZE (16 * 1024)
+#define CORPUS_COUNT 3
+
+const char* corpus_names[CORPUS_COUNT] = {"sensor log", "event log", "state dump"};
+char corpus[CORPUS_SIZE];
+uint8_t compressed_data[CORPUS_SIZE + CORPUS_SIZE / 64];
+uint8_t decompressed_data[CORPUS_SIZE];
+String results;
+
+// Representative console output: timestamps, fixed prefixes and repeated lines with changing values
+size_t fill_corpus(int type) {
+	size_t length = 0;
+	uint32_t timestamp = 0;
+	for (int line = 0; length < CORPUS_SIZE - 128; line++) {
+		timestamp += random(5, 50);
+		int written = 0;
+		char* out = corpus + length;
+		size_t room = CORPUS_SIZE - length;
+		if (type == 0) {
+			written = snprintf(out, room, "[%10lu] sensor %d: temp=%.2f C hum=%.1f %% press=%.1f hPa\n", (unsigned long)timestamp, line % 4, 20 + random(0, 1000) / 100.0, 40 + random(0, 300) / 10.0, 1000 + random(0, 300) / 10.0);
+		}
+		else if (type == 1) {
+			static const char* events[] = {"wifi connected", "mqtt publish ok", "battery check", "button pressed", "heartbeat"};
+			written = snprintf(out, room, "I (%lu) main: %s, heap=%lu\n", (unsigned long)timestamp, events[random(0, 5)], (unsigned long)random(150000, 160000));
+		}
+		else {
+			written = snprintf(out, room, "{\"t\":%lu,\"state\":\"%s\",\"rssi\":%ld,\"queue\":%ld}\n", (unsigned long)timestamp, line % 8 ? "RUNNING" : "IDLE", random(-90, -40), random(0, 16));
+		}
+		length += written;
+	}
+	return length;
+}
+
+void run_benchmark() {
+	for (int type = 0; type < CORPUS_COUNT; type++) {
+		size_t length = fill_corpus(type);
+
+		// Compress in console sized pieces like printf does
+		encoder.reset();
+		size_t packed = 0;
+		uint32_t start = micros();
+		for (size_t offset = 0; offset < length; offset += ARCTIC_LZ_CHUNK) {
+			size_t chunk = min((size_t)ARCTIC_LZ_CHUNK, length - offset);
+			packed += encoder.compress((uint8_t*)corpus + offset, chunk, compressed_data + packed);
+		}
+		uint32_t compress_time = micros() - start;
+
+		decoder.reset();
+		size_t consumed = 0;
+		start = micros();
+		size_t unpacked = decoder.decompress(compressed_data, packed, consumed, decompressed_data, sizeof(decompressed_data));
+		uint32_t decompress_time = micros() - start;
+		bool valid = unpacked == length && memcmp(corpus, decompressed_data, length) == 0;
+
+		char line[160];
+		snprintf(line, sizeof(line), "%-10s %6u -> %6u bytes, ratio %.2f, compress %lu us/KB, decompress %lu us/KB, %s\n",
+			corpus_names[type], (unsigned)length, (unsigned)packed, (float)length / packed,
+			(unsigned long)(compress_time * 1024 / length), (unsigned long)(decompress_time * 1024 / length), valid ? "ok" : "MISMATCH");
+		results += line;
+	}
+	Serial.print(results);
+}
+
+void setup() {
+	Serial.begin(115200);
+
+	arctic_client.begin();
+	arctic_client.add(bench_console);
+	arctic_client.start();
+
+	run_benchmark();
+}
+
+void loop() {
+	bench_console.printf("%s", results.c_str());
+	delay(5000);
+}
\ No newline at end of file
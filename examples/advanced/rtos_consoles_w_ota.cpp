@@ -30,6 +30,7 @@ SlimyTask esp_task_ota(8 * 1024, task_ota, "ota", 1, 1);
 void setup() {
 	Serial.begin(115200);
 
+	arctic_client.async(true); // Tasks only queue their output, a background task sends it
 	arctic_client.begin();
 	arctic_client.add(console_core);
 	arctic_client.add(console_wifi);
@@ -43,52 +44,56 @@ void setup() {
 void task_core(void* pvParameter) {
 	bool core_enabled = false;
 	uint32_t core_counter = 0;
-	
+
+	// Commands of the core console, "help" lists them on the host
+	console_core.command("hide", "", "Hide the wifi console", [](const ArcticCommand& com) {
+		console_core.printf("%lu > Hiding wifi console\n", millis());
+		console_wifi.hide();
+	});
+	console_core.command("show", "", "Show the wifi console", [](const ArcticCommand& com) {
+		console_core.printf("%lu > Showing wifi console\n", millis());
+		console_wifi.show();
+	});
+	console_core.command("enable", "", "Start the core dump", [&](const ArcticCommand& com) {
+		console_core.printf("%lu > Starting core dump\n", millis());
+		core_enabled = true;
+	});
+	console_core.command("disable", "", "Stop the core dump", [&](const ArcticCommand& com) {
+		console_core.printf("%lu > Stopping core dump\n", millis());
+		core_enabled = false;
+	});
+	console_core.command("get_mac", "", "Print the MAC address", [](const ArcticCommand& com) {
+		console_core.printf("%lu > AA:BB:CC:DD:EE:FF\n", millis());
+	});
+	console_core.command("version", "", "Print the firmware version", [](const ArcticCommand& com) {
+		console_core.printf("%lu > Version 1.0.0\n", millis());
+	});
+	console_core.command("reset", "", "Restart the MCU", [](const ArcticCommand& com) {
+		console_core.printf("%lu > Restarting MCU\n", millis());
+		delay(500);
+		ESP.restart();
+	});
+	console_core.command("load", "", "Show a progress bar", [](const ArcticCommand& com) {
+		std::string progress_bar;
+		for (int i = 0; i <= 100; i++) {
+			progress_bar.clear();
+			progress_bar.append(i / 2, '|');
+			progress_bar.append(50 - i / 2, ' ');
+			console_core.singlef("%lu > Loading data |%s| %d%%\n", millis(), progress_bar.c_str(), i);
+			delay(20);
+		}
+	});
+
 	while (1) {
 		if (SYNC_EVENT(10) && core_enabled) {
 			console_core.printf("%lu > Core task is running %d\n", millis(), core_counter);
 			core_counter++;
 		}
 
-		if (console_core.available()) {
-			ArcticCommand com(console_core.read());
-
-			if (com.base() == "hide") {
-				console_core.printf("%lu > Hiding wifi console\n", millis());
-				console_wifi.hide();
-			}
-			if (com.base() == "show") {
-				console_core.printf("%lu > Showing wifi console\n", millis());
-				console_wifi.show();
-			}
-			if (com.base() == "enable") {
-				console_core.printf("%lu > Starting core dump\n", millis());
-				core_enabled = true;
-			}
-			if (com.base() == "disable") {
-				console_core.printf("%lu > Stopping core dump\n", millis());
-				core_enabled = false;
-			}
-			if (com.base() == "get_mac") {
-				console_core.printf("%lu > AA:BB:CC:DD:EE:FF\n", millis());
-			}
-			if (com.base() == "version") {
-				console_core.printf("%lu > Version 1.0.0\n", millis());
-			}
-			if (com.base() == "reset") {
-				console_core.printf("%lu > Restarting MCU\n", millis());
-				delay(500);
-				ESP.restart();
-			}
-			if (com.base() == "load") {
-				std::string progress_bar;
-				for (int i = 0; i <= 100; i++) {
-					progress_bar.clear();
-					progress_bar.append(i / 2, '|');
-					progress_bar.append(50 - i / 2, ' ');
-					console_core.singlef("%lu > Loading data |%s| %d%%\n", millis(), progress_bar.c_str(), i);
-					delay(20);
-				}
+		if (console_core.wait(10)) { // Sleeps until a command arrives, at most 10 ms
+			std::string line = console_core.read();
+			if (!console_core.dispatch(line)) {
+				console_core.printf("%lu > Unknown command [%s], try help\n", millis(), line.c_str());
 			}
 		}
 	}
@@ -96,7 +101,7 @@ void task_core(void* pvParameter) {
 
 void task_wifi(void* pvParameter) {
 	while (1) {
-		if (console_wifi.available()) {
+		if (console_wifi.wait()) { // Sleeps until a command arrives
 			ArcticCommand com(console_wifi.read());
 
 			if (com.base() == "connect") {
@@ -20,7 +20,7 @@ void loop() {
 		
 		if (com.base() == "ping") {
 			if (com.check("-c")) {
-				int count = std::stoi(com.arg("-c"));
+				int count = com.arg("-c", 1, 1, 100); // 1 if missing, not a number or out of 1..100
 				for (int i = 1; i <= count; i++) {
 					simple_console.printf("pong #%d\n", i);
 				}
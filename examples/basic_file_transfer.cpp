@@ -0,0 +1,37 @@
+// Description: Receive files over the OTA service into LittleFS, next to firmware updates.
+// The host sends "ARCTIC_COMMAND_OTA_SETUP -s <size> -md5 <hash> -w <window> -file /model.bin" and the chunks,
+// the file replaces the previous one only when its MD5 matches. Data transfers don't restart the device.
+// "ARCTIC_COMMAND_OTA_READ -file /model.bin" streams the file back to the host.
+
+#include <Arduino.h>
+#include <ArcticClient.h>
+#include <LittleFS.h>
+
+ArcticClient arctic_client;
+ArcticTerminal files_console("Files Console");
+
+void setup() {
+	Serial.begin(115200);
+	LittleFS.begin(true);
+
+	arctic_client.begin();
+	arctic_client.add(files_console);
+	arctic_client.start();
+	arctic_client.ota.filesystem(LittleFS);
+}
+
+void loop() {
+	if (arctic_client.ota.available()) {
+		if (arctic_client.ota.download()) {
+			delay(500);
+			ESP.restart();
+		}
+	}
+
+	if (files_console.wait(100)) {
+		if (files_console.read() == "size") {
+			File file = LittleFS.open("/model.bin", "r");
+			files_console.printf("/model.bin: %u bytes\n", file ? (unsigned)file.size() : 0);
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,24 @@
+// Description: A basic example of how to receive data without polling.
+// Write "ping" to the Callback Console to get "pong" as a response.
+// Each received line is handed to the callback from a background task, loop() is free for other work.
+
+#include <Arduino.h>
+#include <ArcticClient.h>
+
+ArcticClient arctic_client;
+ArcticTerminal callback_console("Callback Console");
+
+void setup() {
+	arctic_client.begin();
+	arctic_client.add(callback_console);
+	arctic_client.onReceive(callback_console, [](const std::string& com) {
+		if (com == "ping") {
+			callback_console.printf("pong\n");
+		}
+	});
+	arctic_client.start();
+}
+
+void loop() {
+	vTaskDelete(NULL);
+}
\ No newline at end of file
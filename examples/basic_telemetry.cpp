@@ -0,0 +1,40 @@
+// Description: A basic example of how to stream numeric samples to the ArcticClient as binary telemetry.
+// Samples skip printf formatting, they are packed in binary and sent on the console telemetry characteristic.
+
+#include <Arduino.h>
+#include <ArcticClient.h>
+
+ArcticClient arctic_client;
+ArcticTerminal telemetry_console("Telemetry Console");
+
+enum { CHANNEL_SINE, CHANNEL_TEMPERATURE, CHANNEL_BLOCK };
+
+void setup() {
+	arctic_client.begin();
+	arctic_client.add(telemetry_console);
+	arctic_client.start();
+
+	// Raw floats, 0.01 C steps in int16 sent as deltas, and 0.001 steps in int32
+	telemetry_console.channel(CHANNEL_SINE, "sine", ARCTIC_TELEMETRY_FLOAT);
+	telemetry_console.channel(CHANNEL_TEMPERATURE, "temperature", ARCTIC_TELEMETRY_INT16, 100, true);
+	telemetry_console.channel(CHANNEL_BLOCK, "block", ARCTIC_TELEMETRY_INT32, 1000);
+}
+
+void loop() {
+	static uint32_t step = 0;
+	step++;
+
+	// One sample at a time
+	telemetry_console.sample(CHANNEL_SINE, sin(2 * PI * step / 500));
+	telemetry_console.sample(CHANNEL_TEMPERATURE, 25 + 0.5 * sin(2 * PI * step / 5000));
+
+	// Or a whole buffer at once
+	if (step % 100 == 0) {
+		float block[32];
+		for (int i = 0; i < 32; i++) {
+			block[i] = cos(2 * PI * i / 32);
+		}
+		telemetry_console.samples(CHANNEL_BLOCK, block, 32);
+	}
+	delay(1);
+}
\ No newline at end of file
@@ -22,42 +22,96 @@
 #include <ArcticTerminal.h>
 #include <ArcticOTA.h>
 
-// Callback Connection per server
+// Callback Connection per server, several centrals may be connected at once
 class ATCallbacks : public NimBLEServerCallbacks {
+	ArcticClient* handler_instance = nullptr;
+
 public:
+	ATCallbacks(ArcticClient* handler) {
+		handler_instance = handler;
+	}
+
 	void onConnect(NimBLEServer* pServer) {
 		ArcticClient::arctic_connection_status = true;
 	};
 
 	void onConnect(NimBLEServer* pServer, ble_gap_conn_desc* desc) {
+		// Every slot taken, a central without one could never subscribe: refuse it instead of leaving it silent
+		if (!ArcticClient::connectionOpened(desc->conn_handle)) {
+			pServer->disconnect(desc->conn_handle);
+			return;
+		}
+
+		// The adaptive profile changes arctic_profile from its timer, read it once
+		BLEConnParams params = ArcticClient::profileParams(ArcticClient::arctic_profile.load());
 		// clang-format off
 		pServer->updateConnParams(
 			desc->conn_handle,
-			ArcticClient::arctic_cparams.min,
-			ArcticClient::arctic_cparams.max,
+			params.min,
+			params.max,
 			0,
-			ArcticClient::arctic_cparams.sup
+			params.sup
 		);
 		// clang-format on
-		NimBLEDevice::setMTU(ArcticClient::arctic_cparams.mtu);
+		NimBLEDevice::setMTU(params.mtu);
 		ArcticClient::arctic_connection_status = true;
+
+		// Advertising stops on connect, keep it going while another central can join
+		if (ArcticClient::connections() < ARCTIC_MAX_CONNECTIONS) {
+			NimBLEDevice::startAdvertising();
+		}
 	};
 
 	void onDisconnect(NimBLEServer* pServer) {
 		NimBLEDevice::startAdvertising();
-		ArcticClient::arctic_connection_status = false;
 	};
 
-	// TODO: Implement MTU negotiation
-	void onMTUChange(uint16_t MTU, ble_gap_conn_desc* desc){
+	// Status stays true while another central is connected
+	void onDisconnect(NimBLEServer* pServer, ble_gap_conn_desc* desc) {
+		handler_instance->disconnected(desc->conn_handle);
+	};
+
+	// The central starts the MTU exchange, TX paths size their notifications from the result
+	void onMTUChange(uint16_t MTU, ble_gap_conn_desc* desc) {
+		ArcticClient::connectionMTU(desc->conn_handle, MTU);
 	};
 };
 
+// Callback TX per console and OTA, notify reports its result here while it runs
+class TxCharacteristicCallbacks : public NimBLECharacteristicCallbacks {
+	ArcticTerminal* console_instance = nullptr;
+	ArcticOTA* ota_instance = nullptr;
+
+public:
+	TxCharacteristicCallbacks(ArcticTerminal* console) {
+		console_instance = console;
+	}
+	TxCharacteristicCallbacks(ArcticOTA* ota) {
+		ota_instance = ota;
+	}
+	// Consoles only format output for characteristics some central subscribed to
+	void onSubscribe(NimBLECharacteristic* pCharacteristic, ble_gap_conn_desc* desc, uint16_t subValue) {
+		if (console_instance) {
+			console_instance->subscribe(pCharacteristic, desc->conn_handle, subValue != 0);
+		}
+	}
+	void onStatus(NimBLECharacteristic* pCharacteristic, Status s, int code) {
+		if (s == Status::ERROR_GATT) {
+			if (console_instance) {
+				console_instance->setTxStatus(code);
+			}
+			if (ota_instance) {
+				ota_instance->setTxStatus(code);
+			}
+		}
+	}
+};
+
 // Callback RX per console
 class RxCharacteristicCallbacks : public NimBLECharacteristicCallbacks {
-	ArcticClient* handler_instance;
-	ArcticTerminal* console_instance;
-	ArcticOTA* ota_instance;
+	ArcticClient* handler_instance = nullptr;
+	ArcticTerminal* console_instance = nullptr;
+	ArcticOTA* ota_instance = nullptr;
 
 public:
 	RxCharacteristicCallbacks(ArcticTerminal* console) {
@@ -70,13 +124,16 @@ public:
 		ota_instance = ota;
 	}
 	void onWrite(NimBLECharacteristic* pCharacteristic) {
+		std::string value = pCharacteristic->getValue();
+		ArcticClient::arctic_rx_bytes += value.size(); // Traffic seen by the adaptive profile
 		if (console_instance) {
-			console_instance->setNewDataAvailable(true, pCharacteristic->getValue());
+			console_instance->setNewDataAvailable(true, value);
 		}
 		if (ota_instance) {
-			ota_instance->setNewDataAvailable(true, pCharacteristic->getValue());
+			ota_instance->setNewDataAvailable(true, value);
 		}
 		if (handler_instance) {
+			handler_instance->setNewDataAvailable(true, value);
 		}
 	}
 };
\ No newline at end of file
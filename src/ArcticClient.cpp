@@ -19,9 +19,20 @@
 #include <ArcticCallbacks.h>
 #include <ArcticClient.h>
 
+#include <esp_timer.h>
+
 // Initialize static variables
 bool ArcticClient::arctic_connection_status = false;
 BLEConnParams ArcticClient::arctic_cparams = {0, 0, 0, 0};
+std::atomic<uint8_t> ArcticClient::arctic_profile{ARCTIC_PROFILE_HIGH_SPEED};
+TaskHandle_t ArcticClient::arctic_tx_task = nullptr;
+TaskHandle_t ArcticClient::arctic_rx_task = nullptr;
+ArcticConnection ArcticClient::arctic_connections[ARCTIC_MAX_CONNECTIONS];
+std::atomic<uint32_t> ArcticClient::arctic_rx_bytes{0};
+std::atomic<uint32_t> ArcticClient::arctic_tx_bytes{0};
+
+// Fixed profile of each adaptive level
+static const uint8_t arctic_governor_profiles[ARCTIC_GOVERNOR_LEVELS] = {ARCTIC_PROFILE_HIGH_SPEED, ARCTIC_PROFILE_BALANCED, ARCTIC_PROFILE_POWER_SAVING};
 
 // Constructor for handler
 ArcticClient::ArcticClient(const std::string& bleDeviceName) {
@@ -34,7 +45,107 @@ ArcticClient::ArcticClient(const std::string& bleDeviceName) {
 void ArcticClient::begin() {
 	NimBLEDevice::init(_bleDeviceName);
 	pServer = NimBLEDevice::createServer();
-	pServer->setCallbacks(new ATCallbacks());
+	pServer->setCallbacks(new ATCallbacks(this));
+}
+
+// MTU: Negotiated MTU of a connection, or the smallest of all of them so one payload fits every central.
+// It never exceeds the MTU the device offers, and is the ATT default until the central negotiates.
+uint16_t ArcticClient::mtu(uint16_t handle) {
+	if (handle == BLE_HS_CONN_HANDLE_NONE) {
+		return mtuOf(0xFFFFFFFF);
+	}
+	int slot = connectionSlot(handle);
+	return slot < 0 ? mtuOf(0) : mtuOf(1u << slot);
+}
+
+// MTU of: Smallest MTU of the connections in a mask of slots, e.g. the centrals subscribed to a characteristic
+uint16_t ArcticClient::mtuOf(uint32_t slots) {
+	uint16_t result = 0;
+	for (size_t i = 0; i < ARCTIC_MAX_CONNECTIONS; i++) {
+		if (!(slots & (1u << i))) continue;
+		if (arctic_connections[i].handle.load() == BLE_HS_CONN_HANDLE_NONE) continue;
+		uint16_t negotiated = arctic_connections[i].mtu.load();
+		if (result == 0 || negotiated < result) {
+			result = negotiated;
+		}
+	}
+	if (result == 0) {
+		result = BLE_ATT_MTU_DFLT;
+	}
+	return std::min(result, arctic_cparams.mtu);
+}
+
+// Connections: Number of centrals connected
+size_t ArcticClient::connections() {
+	size_t count = 0;
+	for (auto& connection : arctic_connections) {
+		if (connection.handle.load() != BLE_HS_CONN_HANDLE_NONE) {
+			count++;
+		}
+	}
+	return count;
+}
+
+// Connection slot: Index of a central in arctic_connections, -1 if it isn't tracked
+int ArcticClient::connectionSlot(uint16_t handle) {
+	if (handle == BLE_HS_CONN_HANDLE_NONE) return -1;
+	for (size_t i = 0; i < ARCTIC_MAX_CONNECTIONS; i++) {
+		if (arctic_connections[i].handle.load() == handle) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Connection parameters: Interval and latency in 1.25 ms units, timeout in 10 ms units, false if the central is gone.
+// Read from the stack, so they follow every parameter update the central accepted.
+bool ArcticClient::connectionParams(uint16_t handle, uint16_t& interval, uint16_t& latency, uint16_t& timeout) {
+	ble_gap_conn_desc desc;
+	if (ble_gap_conn_find(handle, &desc) != 0) return false;
+	interval = desc.conn_itvl;
+	latency = desc.conn_latency;
+	timeout = desc.supervision_timeout;
+	return true;
+}
+
+// Connection opened: Track a new central, its MTU starts at the ATT default. False when every slot is taken.
+bool ArcticClient::connectionOpened(uint16_t handle) {
+	for (auto& connection : arctic_connections) {
+		if (connection.handle.load() == BLE_HS_CONN_HANDLE_NONE) {
+			// Set before the handle, readers skip free entries
+			connection.mtu = BLE_ATT_MTU_DFLT;
+			connection.handle = handle;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Connection closed: Forget a central
+void ArcticClient::connectionClosed(uint16_t handle) {
+	for (auto& connection : arctic_connections) {
+		if (connection.handle.load() == handle) {
+			connection.handle = BLE_HS_CONN_HANDLE_NONE;
+		}
+	}
+}
+
+// Disconnected: Drop the subscriptions of a central from every console, then forget it
+void ArcticClient::disconnected(uint16_t handle) {
+	for (auto& console : consoles) {
+		console.get().unsubscribe(handle);
+	}
+	connectionClosed(handle);
+	arctic_connection_status = connections() > 0;
+}
+
+// Connection MTU: Record the MTU a central negotiated
+void ArcticClient::connectionMTU(uint16_t handle, uint16_t mtu) {
+	for (auto& connection : arctic_connections) {
+		if (connection.handle.load() == handle) {
+			connection.mtu = mtu;
+		}
+	}
 }
 
 // Add console to global map
@@ -80,6 +191,29 @@ void ArcticClient::start() {
 	// Start consoles
 	for (auto& console : consoles) {
 		console.get().start(pServer, pAdvertising);
+		if (_async) {
+			console.get().async(ARCTIC_TX_RING_SIZE);
+		}
+	}
+
+	// Start the TX task that drains every console queue
+	if (_async && arctic_tx_task == nullptr) {
+		xTaskCreate(txTask, "arctic_tx", ARCTIC_TX_TASK_STACK, this, ARCTIC_TX_TASK_PRIORITY, &arctic_tx_task);
+	}
+
+	// Start the task that hands received lines to the onReceive callbacks
+	if (!receivers.empty() && arctic_rx_task == nullptr) {
+		xTaskCreate(rxTask, "arctic_rx", ARCTIC_RX_TASK_STACK, this, ARCTIC_RX_TASK_PRIORITY, &arctic_rx_task);
+	}
+
+	// Start the adaptive profile governor
+	if (_adaptive && _governorTimer == nullptr) {
+		_governorSince = millis();
+		_governorQuiet = _governorSince;
+		_governorRx = arctic_rx_bytes.load();
+		_governorTx = arctic_tx_bytes.load();
+		_governorTimer = xTimerCreate("arctic_gov", pdMS_TO_TICKS(ARCTIC_GOVERNOR_PERIOD), pdTRUE, this, governorTimerCallback);
+		xTimerStart(_governorTimer, 0);
 	}
 
 	// Start advertising
@@ -88,25 +222,149 @@ void ArcticClient::start() {
 	}
 }
 
-// Profile: Set BLE connection parameters
+// Profile: Set BLE connection parameters. The adaptive profile starts balanced and follows the traffic
+// from start() on, the others stay fixed. New connections get the parameters of arctic_profile, a single
+// byte the governor timer can change while the host task reads it.
 void ArcticClient::profile(uint8_t profile) {
+	if (profile > ARCTIC_PROFILE_ADAPTIVE) return;
+	_adaptive = (profile == ARCTIC_PROFILE_ADAPTIVE);
+	if (_adaptive) {
+		profile = ARCTIC_PROFILE_BALANCED;
+		_governor.level = ARCTIC_GOVERNOR_BALANCED;
+		_governor.target = ARCTIC_GOVERNOR_BALANCED;
+	}
+	ArcticClient::arctic_cparams = profileParams(profile);
+	ArcticClient::arctic_profile = profile;
+}
+
+// Profile parameters: Connection intervals of a fixed profile, keeping the MTU offered
+BLEConnParams ArcticClient::profileParams(uint8_t profile) {
 	switch (profile) {
 		case ARCTIC_PROFILE_HIGH_SPEED:
-			ArcticClient::arctic_cparams = {10, 16, 100, arctic_cparams.mtu};
-			break;
+			return {10, 16, 100, arctic_cparams.mtu};
 		case ARCTIC_PROFILE_BALANCED:
-			ArcticClient::arctic_cparams = {24, 40, 200, arctic_cparams.mtu};
-			break;
+			return {24, 40, 200, arctic_cparams.mtu};
 		case ARCTIC_PROFILE_POWER_SAVING: // not fully tested
-			ArcticClient::arctic_cparams = {80, 100, 300, arctic_cparams.mtu};
-			break;
+			return {80, 100, 300, arctic_cparams.mtu};
 		case ARCTIC_PROFILE_LONG_RANGE: // not fully tested
-			ArcticClient::arctic_cparams = {160, 200, 400, arctic_cparams.mtu};
-			break;
+			return {160, 200, 400, arctic_cparams.mtu};
 		case ARCTIC_PROFILE_MAX_SPEED:
-			ArcticClient::arctic_cparams = {6, 8, 50, arctic_cparams.mtu};
-			break;
+			return {6, 8, 50, arctic_cparams.mtu};
 	}
+	return arctic_cparams;
+}
+
+// Governor: Statistics of the adaptive profile, a copy taken while the timer may update them
+ArcticGovernorStats ArcticClient::governor() {
+	ArcticGovernorStats stats = _governor;
+	if (_governorTimer != nullptr) {
+		stats.time[stats.level] += millis() - _governorSince;
+	}
+	return stats;
+}
+
+// Governor timer: Measure the traffic of the last period and adjust the connections to it
+void ArcticClient::governorTimerCallback(TimerHandle_t timer) {
+	ArcticClient* client = static_cast<ArcticClient*>(pvTimerGetTimerID(timer));
+	client->governorStep();
+}
+
+// Governor step: Busy traffic, queued output or dropped output switch to the fast level at once.
+// A quiet link steps down one level per ARCTIC_GOVERNOR_DWELL ms, and traffic between the two
+// thresholds keeps the level or leaves the idle one. Switches are ARCTIC_GOVERNOR_HOLD ms apart.
+void ArcticClient::governorStep() {
+	if (!_adaptive) return;
+	unsigned long now = millis();
+	uint32_t elapsed = now - _governorSince;
+	if (elapsed == 0) return;
+
+	uint32_t rx = arctic_rx_bytes.load();
+	uint32_t tx = arctic_tx_bytes.load();
+	uint32_t queued = 0;
+	uint32_t lost = 0;
+	for (auto& console : consoles) {
+		queued += console.get().queued();
+		lost += console.get().lost() + console.get().lostSamples();
+	}
+	_governor.rxRate = (uint64_t)(rx - _governorRx) * 1000 / elapsed;
+	_governor.txRate = (uint64_t)(tx - _governorTx) * 1000 / elapsed;
+	_governor.queued = queued;
+	_governor.time[_governor.level] += elapsed;
+	bool dropped = lost != _governorLost;
+	_governorRx = rx;
+	_governorTx = tx;
+	_governorLost = lost;
+	_governorSince = now;
+
+	governorConfirm();
+
+	uint32_t rate = _governor.rxRate + _governor.txRate;
+	bool quiet = rate < ARCTIC_GOVERNOR_QUIET && queued == 0 && !dropped;
+	if (!quiet || !arctic_connection_status) {
+		_governorQuiet = now;
+	}
+	if (!arctic_connection_status) return;
+
+	uint8_t level = _governor.target;
+	if (rate >= ARCTIC_GOVERNOR_BUSY || queued >= ARCTIC_GOVERNOR_QUEUE || dropped) {
+		level = ARCTIC_GOVERNOR_FAST;
+	}
+	else if (!quiet && level == ARCTIC_GOVERNOR_IDLE) {
+		level = ARCTIC_GOVERNOR_BALANCED;
+	}
+	else if (quiet && level < ARCTIC_GOVERNOR_IDLE && now - _governorQuiet >= ARCTIC_GOVERNOR_DWELL) {
+		level++;
+	}
+	if (level != _governor.target && (_governor.requests == 0 || now - _governorRequested >= ARCTIC_GOVERNOR_HOLD)) {
+		governorSwitch(level);
+		_governorQuiet = now;
+	}
+}
+
+// Governor switch: Request the parameters of a level on every connection, centrals connecting later get them too.
+// The request is only counted as a switch once governorConfirm() sees the centrals apply it.
+void ArcticClient::governorSwitch(uint8_t level) {
+	arctic_profile = arctic_governor_profiles[level];
+	BLEConnParams params = profileParams(arctic_governor_profiles[level]);
+	for (auto& connection : arctic_connections) {
+		uint16_t handle = connection.handle.load();
+		if (handle == BLE_HS_CONN_HANDLE_NONE) continue;
+		pServer->updateConnParams(handle, params.min, params.max, 0, params.sup);
+	}
+	if (_debug_enabled)
+		Serial.printf("Governor level %u -> %u requested\n", _governor.target, level);
+	_governor.target = level;
+	_governor.requests++;
+	_governorRequested = millis();
+}
+
+// Governor confirm: NimBLE reports no server event for a parameter update, the level switches once the
+// stack shows every connected central at an interval of the requested one. A central refusing keeps it,
+// and with no central connected nothing applied it yet.
+void ArcticClient::governorConfirm() {
+	if (_governor.target == _governor.level) return;
+	BLEConnParams params = profileParams(arctic_governor_profiles[_governor.target]);
+	size_t applied = 0;
+	for (auto& connection : arctic_connections) {
+		uint16_t handle = connection.handle.load();
+		if (handle == BLE_HS_CONN_HANDLE_NONE) continue;
+		uint16_t interval, latency, timeout;
+		if (!connectionParams(handle, interval, latency, timeout)) continue;
+		if (interval < params.min || interval > params.max) return;
+		applied++;
+	}
+	if (applied == 0) return;
+	if (_debug_enabled)
+		Serial.printf("Governor level %u -> %u\n", _governor.level, _governor.target);
+	if (_governor.target < _governor.level) {
+		_governor.faster++;
+	}
+	else {
+		_governor.slower++;
+	}
+	_governor.level = _governor.target;
+	_governor.switches++;
+	_governor.lastSwitch = millis();
 }
 
 // Debug: Enable debug messages
@@ -114,6 +372,46 @@ void ArcticClient::debug(bool status) {
 	_debug_enabled = status;
 }
 
+// Async: Queue console output and send it from a background task, call before start()
+void ArcticClient::async(bool enable) {
+	_async = enable;
+}
+
+// On receive: Call back with each line received by the console, from a client task. Call before start(),
+// the console should not be read anywhere else.
+void ArcticClient::onReceive(ArcticTerminal& console, std::function<void(const std::string&)> callback) {
+	receivers.push_back(Receiver{&console, callback});
+}
+
+// RX task: Sleep until a console receives a write, then pass every queued line to its callback
+void ArcticClient::rxTask(void* parameter) {
+	ArcticClient* client = static_cast<ArcticClient*>(parameter);
+	while (true) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		for (auto& receiver : client->receivers) {
+			while (receiver.console->available()) {
+				std::string line = receiver.console->read();
+				if (line.empty()) continue; // Blank line, nothing to hand over
+				receiver.callback(line);
+			}
+		}
+	}
+}
+
+// TX task: Drain console queues, sleeping until new output or the closest deadline
+void ArcticClient::txTask(void* parameter) {
+	ArcticClient* client = static_cast<ArcticClient*>(parameter);
+	TickType_t wait = portMAX_DELAY;
+	while (true) {
+		ulTaskNotifyTake(pdTRUE, wait);
+		uint32_t next = portMAX_DELAY;
+		for (auto& console : client->consoles) {
+			next = std::min(next, console.get().drain());
+		}
+		wait = (next == portMAX_DELAY) ? portMAX_DELAY : std::max(pdMS_TO_TICKS(next), (TickType_t)1);
+	}
+}
+
 // Create system service
 void ArcticClient::createService(NimBLEAdvertising* existingAdvertising) {
 	NimBLEService* pService = pServer->createService("4fafc201-1fb5-459e-1000-c5c9c3319f00");
@@ -124,6 +422,40 @@ void ArcticClient::createService(NimBLEAdvertising* existingAdvertising) {
 	existingAdvertising->addServiceUUID(pService->getUUID());
 }
 
+// Updates new data flag, processes background commands of the system service
+void ArcticClient::setNewDataAvailable(bool available, std::string command) {
+	ArcticCommand com = ArcticCommand(command);
+
+	// Clock sync: echo the host time with the device time in us, taken right before the reply.
+	// Message timestamps are the low 32 bits of the same clock.
+	if (com.base() == "ARCTIC_COMMAND_SYNC") {
+		char reply[80];
+		ArcticView host = com.arg("-t");
+		int length = snprintf(reply, sizeof(reply), "ARCTIC_COMMAND_REQ_SYNC:%.*s,%llu", (int)host.size(), host.data(), (unsigned long long)esp_timer_get_time());
+		if (length > 0 && (size_t)length < sizeof(reply)) {
+			_txCharacteristic->setValue((uint8_t*)reply, length);
+			_txCharacteristic->notify(true);
+		}
+		return;
+	}
+
+	// Adaptive profile: level, switches, ms since the last one, ms per level, the traffic last measured and the pending request
+	if (com.base() == "ARCTIC_COMMAND_GOVERNOR") {
+		ArcticGovernorStats stats = governor();
+		char reply[160];
+		int length = snprintf(reply, sizeof(reply), "ARCTIC_COMMAND_REQ_GOVERNOR:%u,%u,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%u,%lu", _adaptive ? 1 : 0, stats.level,
+			(unsigned long)stats.switches, (unsigned long)stats.faster, (unsigned long)stats.slower, (unsigned long)(stats.switches ? millis() - stats.lastSwitch : 0),
+			(unsigned long)stats.time[ARCTIC_GOVERNOR_FAST], (unsigned long)stats.time[ARCTIC_GOVERNOR_BALANCED], (unsigned long)stats.time[ARCTIC_GOVERNOR_IDLE],
+			(unsigned long)stats.rxRate, (unsigned long)stats.txRate, (unsigned long)stats.queued, stats.target, (unsigned long)stats.requests);
+		if (length > 0 && (size_t)length < sizeof(reply)) {
+			_txCharacteristic->setValue((uint8_t*)reply, length);
+			_txCharacteristic->notify(true);
+		}
+		return;
+	}
+}
+
+// Connected: True while any central is connected
 bool ArcticClient::connected() {
 	return ArcticClient::arctic_connection_status;
 }
\ No newline at end of file
@@ -19,12 +19,16 @@
 #pragma once
 
 #include <Arduino.h>
+#include <atomic>
 #include <functional>
 #include <sstream>
 #include <string>
 #include <vector>
 #include <map>
 
+#include <freertos/FreeRTOS.h>
+#include <freertos/timers.h>
+
 #include <NimBLEDevice.h>
 
 #include <ArcticOTA.h>
@@ -37,6 +41,70 @@
 #define ARCTIC_PROFILE_POWER_SAVING 0x02
 #define ARCTIC_PROFILE_LONG_RANGE 0x03
 #define ARCTIC_PROFILE_MAX_SPEED 0x04
+#define ARCTIC_PROFILE_ADAPTIVE 0x05
+
+// Adaptive profile: the governor moves the connections between these levels as traffic changes,
+// using the parameters of the HIGH_SPEED, BALANCED and POWER_SAVING profiles
+#define ARCTIC_GOVERNOR_FAST 0
+#define ARCTIC_GOVERNOR_BALANCED 1
+#define ARCTIC_GOVERNOR_IDLE 2
+#define ARCTIC_GOVERNOR_LEVELS 3
+
+// Time (ms) between two traffic measurements
+#ifndef ARCTIC_GOVERNOR_PERIOD
+#define ARCTIC_GOVERNOR_PERIOD 250
+#endif
+
+// Traffic (bytes per second, RX and TX together) that switches to the fast level
+#ifndef ARCTIC_GOVERNOR_BUSY
+#define ARCTIC_GOVERNOR_BUSY 2048
+#endif
+
+// Traffic under which the link is quiet, a quiet link steps down one level per ARCTIC_GOVERNOR_DWELL ms.
+// Between the two thresholds the level is kept.
+#ifndef ARCTIC_GOVERNOR_QUIET
+#define ARCTIC_GOVERNOR_QUIET 128
+#endif
+#ifndef ARCTIC_GOVERNOR_DWELL
+#define ARCTIC_GOVERNOR_DWELL 5000
+#endif
+
+// Async output waiting in the console queues (bytes) that switches to the fast level
+#ifndef ARCTIC_GOVERNOR_QUEUE
+#define ARCTIC_GOVERNOR_QUEUE 512
+#endif
+
+// Min time (ms) between two parameter updates
+#ifndef ARCTIC_GOVERNOR_HOLD
+#define ARCTIC_GOVERNOR_HOLD 1000
+#endif
+
+// Background TX task used in async mode
+#ifndef ARCTIC_TX_TASK_STACK
+#define ARCTIC_TX_TASK_STACK 4096
+#endif
+#ifndef ARCTIC_TX_TASK_PRIORITY
+#define ARCTIC_TX_TASK_PRIORITY 2
+#endif
+
+// Task running onReceive callbacks
+#ifndef ARCTIC_RX_TASK_STACK
+#define ARCTIC_RX_TASK_STACK 4096
+#endif
+#ifndef ARCTIC_RX_TASK_PRIORITY
+#define ARCTIC_RX_TASK_PRIORITY 1
+#endif
+
+// Centrals connected at once, each with its own MTU, parameters and subscriptions
+#ifndef ARCTIC_MAX_CONNECTIONS
+#ifdef CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+#define ARCTIC_MAX_CONNECTIONS CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+#else
+#define ARCTIC_MAX_CONNECTIONS 3
+#endif
+#endif
+// Subscriptions are kept as one bit per connection slot
+static_assert(ARCTIC_MAX_CONNECTIONS > 0 && ARCTIC_MAX_CONNECTIONS <= 32, "ARCTIC_MAX_CONNECTIONS must be between 1 and 32");
 
 // Some OS may require this services to be enabled
 #ifdef ARCTIC_ENABLE_DEFAULT_SERVICES
@@ -58,6 +126,27 @@ struct BLEConnParams {
 	uint16_t mtu;
 };
 
+// Connected central, written by the BLE host task and read by the TX paths
+struct ArcticConnection {
+	std::atomic<uint16_t> handle{BLE_HS_CONN_HANDLE_NONE};
+	std::atomic<uint16_t> mtu{BLE_ATT_MTU_DFLT};
+};
+
+// Adaptive profile statistics, since start()
+struct ArcticGovernorStats {
+	uint8_t level = ARCTIC_GOVERNOR_BALANCED;  // Level every connected central applied
+	uint8_t target = ARCTIC_GOVERNOR_BALANCED; // Level last requested, differs from level until it is applied
+	uint32_t requests = 0;   // Level changes requested from the centrals
+	uint32_t switches = 0;   // Level changes the centrals applied
+	uint32_t faster = 0;     // Switches to a shorter interval
+	uint32_t slower = 0;     // Switches to a longer interval
+	uint32_t lastSwitch = 0; // millis() of the last switch
+	uint32_t time[ARCTIC_GOVERNOR_LEVELS] = {}; // ms spent at each level
+	uint32_t rxRate = 0;     // Bytes per second received over the last period
+	uint32_t txRate = 0;     // Bytes per second sent over the last period
+	uint32_t queued = 0;     // Async output waiting at the last period
+};
+
 class ArcticClient {
 public:
 	ArcticClient(const std::string& bleDeviceName = "ArcticTerminal");
@@ -65,20 +154,65 @@ public:
 	void add(ArcticTerminal& console); // Register data console
 	void start();
 	void profile(uint8_t profile);
+	ArcticGovernorStats governor();
 	void debug(bool enable);
+	void async(bool enable);
+	void onReceive(ArcticTerminal& console, std::function<void(const std::string&)> callback);
 	void createService(NimBLEAdvertising* existingAdvertising);
 	bool connected();
+	void setNewDataAvailable(bool available, std::string command);
+	static uint16_t mtu(uint16_t handle = BLE_HS_CONN_HANDLE_NONE);
+	static uint16_t mtuOf(uint32_t slots);
+	static size_t connections();
+	static int connectionSlot(uint16_t handle);
+	static BLEConnParams profileParams(uint8_t profile);
+	static bool connectionParams(uint16_t handle, uint16_t& interval, uint16_t& latency, uint16_t& timeout);
+	static bool connectionOpened(uint16_t handle);
+	static void connectionClosed(uint16_t handle);
+	static void connectionMTU(uint16_t handle, uint16_t mtu);
 	static bool arctic_connection_status;
 	static BLEConnParams arctic_cparams;
+	static std::atomic<uint8_t> arctic_profile;
+	static ArcticConnection arctic_connections[ARCTIC_MAX_CONNECTIONS];
+	static TaskHandle_t arctic_tx_task;
+	static TaskHandle_t arctic_rx_task;
+	static std::atomic<uint32_t> arctic_rx_bytes;
+	static std::atomic<uint32_t> arctic_tx_bytes;
 	ArcticOTA ota;
 	NimBLECharacteristic* _txCharacteristic;
 	NimBLECharacteristic* _rxCharacteristic;
+	void disconnected(uint16_t handle);
 
 private:
 	std::string _bleDeviceName;
 	bool _debug_enabled = false;
 	bool _ota_console = false;
+	bool _async = false;
 	NimBLEServer* pServer;
 	NimBLEAdvertising* pAdvertising;
 	std::vector<std::reference_wrapper<ArcticTerminal>> consoles;
+
+	struct Receiver {
+		ArcticTerminal* console;
+		std::function<void(const std::string&)> callback;
+	};
+	std::vector<Receiver> receivers;
+
+	// Adaptive profile, stepped by a timer every ARCTIC_GOVERNOR_PERIOD ms
+	bool _adaptive = false;
+	ArcticGovernorStats _governor;
+	TimerHandle_t _governorTimer = nullptr;
+	unsigned long _governorSince = 0;
+	unsigned long _governorQuiet = 0;
+	unsigned long _governorRequested = 0;
+	uint32_t _governorRx = 0;
+	uint32_t _governorTx = 0;
+	uint32_t _governorLost = 0;
+
+	void governorStep();
+	void governorSwitch(uint8_t level);
+	void governorConfirm();
+	static void governorTimerCallback(TimerHandle_t timer);
+	static void txTask(void* parameter);
+	static void rxTask(void* parameter);
 };
\ No newline at end of file
@@ -20,51 +20,376 @@
 
 #include <Arduino.h>
 
-#include <sstream>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
 #include <string>
-#include <map>
+#include <type_traits>
 
+// Longest command parsed, longer input is cut
+#ifndef ARCTIC_COMMAND_SIZE
+#define ARCTIC_COMMAND_SIZE 256
+#endif
+
+// Arguments kept per command, the rest are ignored
+#ifndef ARCTIC_COMMAND_ARGS
+#define ARCTIC_COMMAND_ARGS 16
+#endif
+
+// Background commands exchanged with the host start with this prefix, anything else is user data
+#define ARCTIC_COMMAND_PREFIX "ARCTIC_COMMAND_"
+#define ARCTIC_COMMAND_PREFIX_LENGTH 15
+
+// Status of a typed argument
+#define ARCTIC_ARG_OK 0x00
+#define ARCTIC_ARG_MISSING 0x01 // key not given
+#define ARCTIC_ARG_INVALID 0x02 // value is not a number of the type, or not one of the choices
+#define ARCTIC_ARG_RANGE 0x03 // value doesn't fit the type or the given limits
+
+// Non owning view of a string, std::string_view is not available before C++17
+class ArcticView {
+public:
+	ArcticView() : _data(""), _size(0) {}
+	ArcticView(const char* data, size_t size) : _data(data), _size(size) {}
+	ArcticView(const char* text) : _data(text), _size(strlen(text)) {}
+	ArcticView(const std::string& text) : _data(text.data()), _size(text.size()) {}
+
+	const char* data() const {
+		return _data;
+	}
+
+	size_t size() const {
+		return _size;
+	}
+
+	bool empty() const {
+		return _size == 0;
+	}
+
+	const char* begin() const {
+		return _data;
+	}
+
+	const char* end() const {
+		return _data + _size;
+	}
+
+	char operator[](size_t index) const {
+		return _data[index];
+	}
+
+	// Copy, only when the text has to outlive the command
+	std::string str() const {
+		return std::string(_data, _size);
+	}
+
+	operator std::string() const {
+		return str();
+	}
+
+	friend bool operator==(const ArcticView& a, const ArcticView& b) {
+		return a._size == b._size && memcmp(a._data, b._data, a._size) == 0;
+	}
+
+	friend bool operator!=(const ArcticView& a, const ArcticView& b) {
+		return !(a == b);
+	}
+
+private:
+	const char* _data;
+	size_t _size;
+};
+
+// Name of an enum value accepted by an argument, for arg() and get() with choices
+template <typename T>
+struct ArcticChoice {
+	const char* name;
+	T value;
+};
+
+// Command line parsed in place, without heap allocations.
+// "base -k value --key=value -f "quoted value"": the first word is the base, words starting with '-'
+// are keys and the word after a key is its value. Quotes group words and protect a value starting
+// with '-', \" and \\ are escapes inside double quotes. A negative number after a key is its value.
+// Views returned by base(), check() and arg() point into the command and live as long as it does.
 class ArcticCommand {
 public:
-	ArcticCommand(const std::string& input) {
-		std::istringstream stream(input);
-		std::string token;
-		std::string lastKey;
-
-		stream >> baseCommand;
-		while (stream >> token) {
-			if (token[0] == '-') {
-				lastKey = token;
-				arguments[token] = "";
+	ArcticCommand(ArcticView input) {
+		parse(input);
+	}
+
+	// System check: A prefix compare, so RX callbacks only parse their own commands
+	static bool isSystem(ArcticView data) {
+		return data.size() >= ARCTIC_COMMAND_PREFIX_LENGTH && memcmp(data.data(), ARCTIC_COMMAND_PREFIX, ARCTIC_COMMAND_PREFIX_LENGTH) == 0;
+	}
+
+	ArcticView base() const {
+		return view(_base);
+	}
+
+	bool check(ArcticView key) const {
+		return find(key) != nullptr;
+	}
+
+	ArcticView arg(ArcticView key) const {
+		const Argument* argument = find(key);
+		if (argument != nullptr) {
+			return view(argument->value);
+		}
+		return ArcticView();
+	}
+
+	// Typed argument: Value of the key, or fallback if it is missing or not valid
+	template <typename T>
+	T arg(ArcticView key, T fallback) const {
+		get(key, fallback);
+		return fallback;
+	}
+
+	template <typename T>
+	T arg(ArcticView key, T fallback, T min, T max) const {
+		get(key, fallback, min, max);
+		return fallback;
+	}
+
+	template <typename T, size_t N>
+	T arg(ArcticView key, T fallback, const ArcticChoice<T> (&choices)[N]) const {
+		get(key, fallback, choices);
+		return fallback;
+	}
+
+	// Typed argument: Parse the value of the key without exceptions, value is only written on ARCTIC_ARG_OK.
+	// Integers are decimal or 0x hex, bool accepts 1/0, true/false, on/off, yes/no or a key without value.
+	template <typename T>
+	uint8_t get(ArcticView key, T& value) const {
+		const Argument* argument = find(key);
+		if (argument == nullptr) return ARCTIC_ARG_MISSING;
+		return parse(view(argument->value), value);
+	}
+
+	template <typename T>
+	uint8_t get(ArcticView key, T& value, T min, T max) const {
+		T parsed;
+		uint8_t status = get(key, parsed);
+		if (status != ARCTIC_ARG_OK) return status;
+		// Written as a positive test so a NaN never passes the bounds
+		if (!(parsed >= min && parsed <= max)) return ARCTIC_ARG_RANGE;
+		value = parsed;
+		return ARCTIC_ARG_OK;
+	}
+
+	template <typename T, size_t N>
+	uint8_t get(ArcticView key, T& value, const ArcticChoice<T> (&choices)[N]) const {
+		const Argument* argument = find(key);
+		if (argument == nullptr) return ARCTIC_ARG_MISSING;
+		ArcticView text = view(argument->value);
+		for (size_t i = 0; i < N; i++) {
+			if (text == choices[i].name) {
+				value = choices[i].value;
+				return ARCTIC_ARG_OK;
 			}
-			else if (!lastKey.empty()) {
-				arguments[lastKey] = token;
-				// Serial.printf("Parsed argument: %s, Value: %s\n", lastKey.c_str(), token.c_str()); // Corrected debug output
-				lastKey = "";
+		}
+		return ARCTIC_ARG_INVALID;
+	}
+
+private:
+	// Offsets into _buffer, so copies of a command stay valid
+	struct Token {
+		uint16_t offset;
+		uint16_t length;
+	};
+
+	struct Argument {
+		Token key;
+		Token value;
+	};
+
+	char _buffer[ARCTIC_COMMAND_SIZE];
+	Token _base = {0, 0};
+	Argument _arguments[ARCTIC_COMMAND_ARGS];
+	size_t _count = 0;
+
+	// Tokens are unquoted into the buffer as they are read, never past the read position
+	void parse(ArcticView input) {
+		size_t length = std::min(input.size(), (size_t)ARCTIC_COMMAND_SIZE);
+		memcpy(_buffer, input.data(), length);
+
+		size_t read = 0;
+		size_t write = 0;
+		bool first = true;
+		bool pending = false; // last key still has no value
+		while (true) {
+			while (read < length && isspace((uint8_t)_buffer[read])) {
+				read++;
+			}
+			if (read >= length) break;
+
+			Token token = {(uint16_t)write, 0};
+			bool quoted = false;
+			char quote = 0;
+			while (read < length) {
+				char c = _buffer[read];
+				if (quote) {
+					read++;
+					if (c == quote) {
+						quote = 0;
+						continue;
+					}
+					if (c == '\\' && quote == '"' && read < length && (_buffer[read] == '"' || _buffer[read] == '\\')) {
+						c = _buffer[read++];
+					}
+				} else if (c == '"' || c == '\'') {
+					quote = c;
+					quoted = true;
+					read++;
+					continue;
+				} else if (isspace((uint8_t)c)) {
+					break;
+				} else {
+					read++;
+				}
+				_buffer[write++] = c;
+			}
+			token.length = write - token.offset;
+
+			if (first) {
+				_base = token;
+				first = false;
+			} else if (!quoted && isKey(token, pending)) {
+				pending = false;
+				if (_count == ARCTIC_COMMAND_ARGS) continue;
+				Argument& argument = _arguments[_count++];
+				argument.key = token;
+				argument.value = {token.offset, 0};
+
+				// --key=value
+				const char* text = _buffer + token.offset;
+				const char* equal = (const char*)memchr(text, '=', token.length);
+				if (token.length > 2 && text[1] == '-' && equal != nullptr) {
+					argument.key.length = equal - text;
+					argument.value = {(uint16_t)(equal + 1 - _buffer), (uint16_t)(token.length - (equal + 1 - text))};
+				} else {
+					pending = true;
+				}
+			} else if (pending) {
+				_arguments[_count - 1].value = token;
+				pending = false;
+			}
+		}
+	}
+
+	bool isKey(const Token& token, bool pending) const {
+		if (token.length == 0 || _buffer[token.offset] != '-') return false;
+		if (pending && token.length > 1) {
+			char next = _buffer[token.offset + 1];
+			if (isdigit((uint8_t)next) || next == '.') return false;
+		}
+		return true;
+	}
+
+	// Last occurrence wins, like repeated options on a command line
+	const Argument* find(ArcticView key) const {
+		for (size_t i = _count; i > 0; i--) {
+			if (view(_arguments[i - 1].key) == key) {
+				return &_arguments[i - 1];
 			}
 		}
+		return nullptr;
+	}
+
+	ArcticView view(const Token& token) const {
+		return ArcticView(_buffer + token.offset, token.length);
+	}
 
-		// Debugging output
-		// Serial.printf("Base command: %s\n", baseCommand.c_str());
+	template <typename T>
+	static typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value, uint8_t>::type parse(ArcticView text, T& value) {
+		int64_t parsed;
+		uint8_t status = parseSigned(text, parsed);
+		if (status != ARCTIC_ARG_OK) return status;
+		if (parsed < (int64_t)std::numeric_limits<T>::min() || parsed > (int64_t)std::numeric_limits<T>::max()) return ARCTIC_ARG_RANGE;
+		value = (T)parsed;
+		return ARCTIC_ARG_OK;
 	}
 
-	std::string base() const {
-		return baseCommand;
+	template <typename T>
+	static typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value, uint8_t>::type parse(ArcticView text, T& value) {
+		uint64_t parsed;
+		uint8_t status = parseUnsigned(text, parsed);
+		if (status != ARCTIC_ARG_OK) return status;
+		if (parsed > (uint64_t)std::numeric_limits<T>::max()) return ARCTIC_ARG_RANGE;
+		value = (T)parsed;
+		return ARCTIC_ARG_OK;
 	}
 
-	bool check(const std::string& arg) const {
-		return arguments.find(arg) != arguments.end();
+	template <typename T>
+	static typename std::enable_if<std::is_floating_point<T>::value, uint8_t>::type parse(ArcticView text, T& value) {
+		// strtod needs a terminated string, numbers longer than the copy are not valid anyway
+		char number[32];
+		if (text.empty() || text.size() >= sizeof(number) || isspace((uint8_t)text[0])) return ARCTIC_ARG_INVALID;
+		memcpy(number, text.data(), text.size());
+		number[text.size()] = 0;
+		char* end;
+		errno = 0;
+		double parsed = strtod(number, &end);
+		if (end != number + text.size()) return ARCTIC_ARG_INVALID;
+		if (parsed != parsed) return ARCTIC_ARG_INVALID; // strtod accepts "nan", it is not a number here
+		if (errno == ERANGE || parsed > std::numeric_limits<T>::max() || parsed < -std::numeric_limits<T>::max()) return ARCTIC_ARG_RANGE;
+		value = (T)parsed;
+		return ARCTIC_ARG_OK;
 	}
 
-	std::string arg(const std::string& arg) const {
-		auto it = arguments.find(arg);
-		if (it != arguments.end()) {
-			return it->second;
+	static uint8_t parse(ArcticView text, bool& value) {
+		static const char* const names[] = {"1", "true", "on", "yes", "0", "false", "off", "no"};
+		if (text.empty()) {
+			value = true;
+			return ARCTIC_ARG_OK;
+		}
+		for (size_t i = 0; i < 8; i++) {
+			if (text.size() == strlen(names[i]) && strncasecmp(text.data(), names[i], text.size()) == 0) {
+				value = i < 4;
+				return ARCTIC_ARG_OK;
+			}
 		}
-		return "";
+		return ARCTIC_ARG_INVALID;
 	}
 
-private:
-	std::string baseCommand;
-	std::map<std::string, std::string> arguments;
+	static uint8_t parseUnsigned(ArcticView text, uint64_t& value) {
+		size_t i = 0;
+		if (i < text.size() && text[i] == '+') i++;
+		uint64_t base = 10;
+		if (i + 1 < text.size() && text[i] == '0' && (text[i + 1] == 'x' || text[i + 1] == 'X')) {
+			base = 16;
+			i += 2;
+		}
+		if (i == text.size()) return ARCTIC_ARG_INVALID;
+
+		uint64_t parsed = 0;
+		for (; i < text.size(); i++) {
+			char c = text[i];
+			uint64_t digit;
+			if (c >= '0' && c <= '9') digit = c - '0';
+			else if (base == 16 && c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+			else if (base == 16 && c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+			else return ARCTIC_ARG_INVALID;
+			if (parsed > (std::numeric_limits<uint64_t>::max() - digit) / base) return ARCTIC_ARG_RANGE;
+			parsed = parsed * base + digit;
+		}
+		value = parsed;
+		return ARCTIC_ARG_OK;
+	}
+
+	static uint8_t parseSigned(ArcticView text, int64_t& value) {
+		bool negative = !text.empty() && text[0] == '-';
+		uint64_t magnitude;
+		uint8_t status = parseUnsigned(negative ? ArcticView(text.data() + 1, text.size() - 1) : text, magnitude);
+		if (status != ARCTIC_ARG_OK) return status;
+		if (negative && text.size() > 1 && text[1] == '+') return ARCTIC_ARG_INVALID;
+		uint64_t limit = (uint64_t)std::numeric_limits<int64_t>::max() + (negative ? 1 : 0);
+		if (magnitude > limit) return ARCTIC_ARG_RANGE;
+		value = negative ? (int64_t)(0 - magnitude) : (int64_t)magnitude;
+		return ARCTIC_ARG_OK;
+	}
 };
\ No newline at end of file
@@ -0,0 +1,166 @@
+/*
+ * This file is part of ArcticTerminal Library.
+ * Copyright (C) 2023 Alejandro Nicolini
+ *
+ * ArcticTerminal is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ArcticTerminal is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ArcticTerminal. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+
+// Sequential bsdiff patch, a list of records:
+// [diff length][extra length][seek]   varints, seek is zigzag encoded
+// [diff bytes][extra bytes]           diff bytes are added to the base from the cursor, extra bytes are new
+// The cursor moves past the diff bytes and then by seek. The patch is mostly zeros, it is sent
+// compressed and the decoder works on the output of an ArcticLZDecoder.
+
+// Base bytes read at once, the only part of the base image kept in RAM
+#ifndef ARCTIC_DELTA_BLOCK
+#define ARCTIC_DELTA_BLOCK 256
+#endif
+
+// Streaming patch decoder, input can be cut anywhere and output is produced as room allows
+class ArcticDeltaDecoder {
+public:
+	// Reads length bytes of the base image at offset, false if it can't
+	typedef std::function<bool(uint32_t offset, uint8_t* data, size_t length)> Reader;
+
+	ArcticDeltaDecoder() {
+		reset(0, nullptr);
+	}
+
+	// Start a new patch against a base image of base_size bytes
+	void reset(uint32_t base_size, Reader reader) {
+		_reader = reader;
+		_base_size = base_size;
+		_block_offset = 0;
+		_block_length = 0;
+		_cursor = 0;
+		_diff = 0;
+		_extra = 0;
+		_seek = 0;
+		_varint = 0;
+		_shift = 0;
+		_state = DIFF_LENGTH;
+		_error = false;
+	}
+
+	// Set once the patch is malformed or reaches outside the base image
+	bool error() const {
+		return _error;
+	}
+
+	// Decode up to capacity bytes, consumed returns how much input was used
+	size_t decode(const uint8_t* in, size_t length, size_t& consumed, uint8_t* out, size_t capacity) {
+		size_t read = 0;
+		size_t produced = 0;
+		while (read < length && !_error) {
+			if (_state == DIFF || _state == EXTRA) {
+				size_t count = std::min(length - read, capacity - produced);
+				count = std::min(count, (size_t)(_state == DIFF ? _diff : _extra));
+				if (count == 0) break;
+				if (_state == DIFF) {
+					for (size_t i = 0; i < count && !_error; i++) {
+						uint8_t value = 0;
+						_error = !base(value);
+						out[produced + i] = in[read + i] + value;
+					}
+					_diff -= count;
+				}
+				else {
+					memcpy(out + produced, in + read, count);
+					_extra -= count;
+				}
+				read += count;
+				produced += count;
+				next();
+				continue;
+			}
+
+			// Record header, one varint byte at a time
+			uint8_t value = in[read++];
+			_varint |= (uint32_t)(value & 0x7F) << _shift;
+			_shift += 7;
+			if (value & 0x80) {
+				_error = _shift >= 32;
+				continue;
+			}
+			switch (_state) {
+			case DIFF_LENGTH:
+				_diff = _varint;
+				_state = EXTRA_LENGTH;
+				break;
+			case EXTRA_LENGTH:
+				_extra = _varint;
+				_state = SEEK;
+				break;
+			default:
+				_seek = (int32_t)(_varint >> 1) ^ -(int32_t)(_varint & 1);
+				_state = DIFF;
+				next();
+				break;
+			}
+			_varint = 0;
+			_shift = 0;
+		}
+		consumed = read;
+		return produced;
+	}
+
+private:
+	enum State : uint8_t { DIFF_LENGTH, EXTRA_LENGTH, SEEK, DIFF, EXTRA };
+
+	Reader _reader;
+	uint32_t _base_size;
+	uint8_t _block[ARCTIC_DELTA_BLOCK];
+	uint32_t _block_offset;
+	size_t _block_length;
+	uint32_t _cursor;
+	uint32_t _diff;
+	uint32_t _extra;
+	int32_t _seek;
+	uint32_t _varint;
+	uint8_t _shift;
+	State _state;
+	bool _error;
+
+	// Skip the empty parts of a record, the seek applies once it is done
+	void next() {
+		if (_state == DIFF && _diff == 0) _state = EXTRA;
+		if (_state == EXTRA && _extra == 0) {
+			_cursor += _seek;
+			_state = DIFF_LENGTH;
+		}
+	}
+
+	// Next base byte at the cursor, a new block is read when it leaves the current one
+	bool base(uint8_t& value) {
+		if (_cursor - _block_offset >= _block_length) {
+			if (_cursor >= _base_size || !_reader) return false;
+			_block_offset = _cursor;
+			_block_length = std::min((uint32_t)ARCTIC_DELTA_BLOCK, _base_size - _cursor);
+			if (!_reader(_block_offset, _block, _block_length)) {
+				_block_length = 0;
+				return false;
+			}
+		}
+		value = _block[_cursor++ - _block_offset];
+		return true;
+	}
+};
\ No newline at end of file
@@ -0,0 +1,237 @@
+/*
+ * This file is part of ArcticTerminal Library.
+ * Copyright (C) 2023 Alejandro Nicolini
+ *
+ * ArcticTerminal is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ArcticTerminal is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ArcticTerminal. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Byte aligned LZ77 stream, every token starts with a tag byte:
+// 0LLLLLLL                  literal run of L + 1 bytes following the tag
+// 1LLLLDDD DDDDDDDD [E]     match of L + 3 bytes, D + 1 bytes back, L = 15 adds E
+// Tokens never stay open between calls, so the output can be sent at any point and the
+// receiver decodes notifications as they arrive.
+#define ARCTIC_LZ_WINDOW 2048
+#define ARCTIC_LZ_MIN_MATCH 3
+#define ARCTIC_LZ_MAX_MATCH (ARCTIC_LZ_MIN_MATCH + 15 + 255)
+#define ARCTIC_LZ_MAX_LITERAL 128
+
+// Input compressed per step, output never exceeds it by more than ARCTIC_LZ_OVERHEAD
+#define ARCTIC_LZ_CHUNK 256
+#define ARCTIC_LZ_OVERHEAD 3
+
+// Match finder table size, 2 bytes per entry
+#ifndef ARCTIC_LZ_HASH_BITS
+#define ARCTIC_LZ_HASH_BITS 10
+#endif
+
+// Streaming compressor, keeps the last ARCTIC_LZ_WINDOW bytes as history
+class ArcticLZEncoder {
+public:
+	ArcticLZEncoder() {
+		reset();
+	}
+
+	// Start a new stream, the decoder must be reset too
+	void reset() {
+		_position = 0;
+		memset(_hash, 0, sizeof(_hash));
+	}
+
+	// Largest output for length bytes of input
+	static size_t bound(size_t length) {
+		return length + ((length + ARCTIC_LZ_CHUNK - 1) / ARCTIC_LZ_CHUNK) * ARCTIC_LZ_OVERHEAD;
+	}
+
+	// Compress length bytes into out, which must hold bound(length) bytes. Returns the output size
+	size_t compress(const uint8_t* in, size_t length, uint8_t* out) {
+		size_t written = 0;
+		while (length > 0) {
+			size_t chunk = length < ARCTIC_LZ_CHUNK ? length : ARCTIC_LZ_CHUNK;
+			written += compressChunk(in, chunk, out + written);
+			in += chunk;
+			length -= chunk;
+		}
+		return written;
+	}
+
+private:
+	uint8_t _window[ARCTIC_LZ_WINDOW];
+	uint16_t _hash[1 << ARCTIC_LZ_HASH_BITS];
+	uint32_t _position;
+
+	static uint32_t hashOf(const uint8_t* data) {
+		uint32_t value = (data[0] << 16) | (data[1] << 8) | data[2];
+		return (value * 2654435761u) >> (32 - ARCTIC_LZ_HASH_BITS);
+	}
+
+	// Only the low 16 bits of a position are stored, the bytes are compared before any match is used
+	void insert(const uint8_t* data, uint32_t position) {
+		_hash[hashOf(data)] = (uint16_t)position;
+	}
+
+	size_t compressChunk(const uint8_t* in, size_t length, uint8_t* out) {
+		// Whole chunk goes in the history first, matches may overlap the bytes being encoded
+		uint32_t base = _position;
+		for (size_t i = 0; i < length; i++) {
+			_window[(base + i) & (ARCTIC_LZ_WINDOW - 1)] = in[i];
+		}
+		uint32_t end = base + length;
+		uint32_t oldest = end > ARCTIC_LZ_WINDOW ? end - ARCTIC_LZ_WINDOW : 0;
+
+		size_t written = 0;
+		size_t literals = 0;
+		size_t i = 0;
+		while (i < length) {
+			size_t best = 0;
+			uint32_t distance = 0;
+			uint32_t position = base + i;
+			if (i + ARCTIC_LZ_MIN_MATCH <= length) {
+				uint32_t slot = hashOf(in + i);
+				distance = (uint16_t)(position - _hash[slot]);
+				_hash[slot] = (uint16_t)position;
+				if (distance > 0 && distance <= ARCTIC_LZ_WINDOW && distance <= position && position - distance >= oldest) {
+					uint32_t candidate = position - distance;
+					size_t limit = length - i < ARCTIC_LZ_MAX_MATCH ? length - i : ARCTIC_LZ_MAX_MATCH;
+					while (best < limit && _window[(candidate + best) & (ARCTIC_LZ_WINDOW - 1)] == in[i + best]) {
+						best++;
+					}
+				}
+			}
+			if (best < ARCTIC_LZ_MIN_MATCH) {
+				literals++;
+				i++;
+				continue;
+			}
+
+			written += emitLiterals(in + i - literals, literals, out + written);
+			literals = 0;
+			size_t code = best - ARCTIC_LZ_MIN_MATCH < 15 ? best - ARCTIC_LZ_MIN_MATCH : 15;
+			out[written++] = 0x80 | (code << 3) | ((distance - 1) >> 8);
+			out[written++] = (distance - 1) & 0xFF;
+			if (code == 15) {
+				out[written++] = best - ARCTIC_LZ_MIN_MATCH - 15;
+			}
+			for (size_t k = 1; k < best && i + k + ARCTIC_LZ_MIN_MATCH <= length; k++) {
+				insert(in + i + k, position + k);
+			}
+			i += best;
+		}
+		written += emitLiterals(in + length - literals, literals, out + written);
+		_position = end;
+		return written;
+	}
+
+	static size_t emitLiterals(const uint8_t* in, size_t length, uint8_t* out) {
+		size_t written = 0;
+		while (length > 0) {
+			size_t run = length < ARCTIC_LZ_MAX_LITERAL ? length : ARCTIC_LZ_MAX_LITERAL;
+			out[written++] = run - 1;
+			memcpy(out + written, in, run);
+			written += run;
+			in += run;
+			length -= run;
+		}
+		return written;
+	}
+};
+
+// Streaming decompressor, input can be cut anywhere and output is produced as room allows
+class ArcticLZDecoder {
+public:
+	ArcticLZDecoder() {
+		reset();
+	}
+
+	void reset() {
+		_position = 0;
+		_state = TAG;
+		_remaining = 0;
+		_distance = 0;
+		_tag = 0;
+		_error = false;
+	}
+
+	// Set once the stream references data it never had
+	bool error() const {
+		return _error;
+	}
+
+	// Decode up to capacity bytes, consumed returns how much input was used
+	size_t decompress(const uint8_t* in, size_t length, size_t& consumed, uint8_t* out, size_t capacity) {
+		size_t read = 0;
+		size_t produced = 0;
+		while (produced < capacity && !_error) {
+			if (_state == COPY) {
+				uint8_t value = _window[(_position - _distance) & (ARCTIC_LZ_WINDOW - 1)];
+				out[produced++] = put(value);
+				if (--_remaining == 0) _state = TAG;
+				continue;
+			}
+			if (read == length) break;
+			uint8_t value = in[read++];
+			switch (_state) {
+			case TAG:
+				if (value & 0x80) {
+					_tag = value;
+					_state = OFFSET;
+				}
+				else {
+					_remaining = value + 1;
+					_state = LITERAL;
+				}
+				break;
+			case LITERAL:
+				out[produced++] = put(value);
+				if (--_remaining == 0) _state = TAG;
+				break;
+			case OFFSET:
+				_distance = (((_tag & 0x07) << 8) | value) + 1;
+				_remaining = ((_tag >> 3) & 0x0F) + ARCTIC_LZ_MIN_MATCH;
+				_state = (_remaining == ARCTIC_LZ_MIN_MATCH + 15) ? EXTRA : COPY;
+				_error = _distance > _position;
+				break;
+			case EXTRA:
+				_remaining += value;
+				_state = COPY;
+				break;
+			default:
+				break;
+			}
+		}
+		consumed = read;
+		return produced;
+	}
+
+private:
+	enum State : uint8_t { TAG, LITERAL, OFFSET, EXTRA, COPY };
+
+	uint8_t _window[ARCTIC_LZ_WINDOW];
+	uint32_t _position;
+	State _state;
+	uint16_t _remaining;
+	uint16_t _distance;
+	uint8_t _tag;
+	bool _error;
+
+	uint8_t put(uint8_t value) {
+		_window[_position++ & (ARCTIC_LZ_WINDOW - 1)] = value;
+		return value;
+	}
+};
\ No newline at end of file
@@ -22,6 +22,9 @@
 // Constructor for consoles
 ArcticOTA::ArcticOTA() {
 	pServer = nullptr;
+	for (size_t i = 0; i < ARCTIC_OTA_WINDOW_MAX; i++) {
+		_ota_slot_offset[i] = ARCTIC_OTA_FREE;
+	}
 }
 
 // Start: Create server and service
@@ -29,6 +32,9 @@ void ArcticOTA::start(NimBLEServer* existingServer, NimBLEAdvertising* existingA
 	if (existingServer != nullptr) {
 		pServer = existingServer;
 	}
+	if (_ota_mutex == nullptr) {
+		_ota_mutex = xSemaphoreCreateMutex();
+	}
 	createService(existingAdvertising);
 }
 
@@ -36,6 +42,7 @@ void ArcticOTA::start(NimBLEServer* existingServer, NimBLEAdvertising* existingA
 void ArcticOTA::createService(NimBLEAdvertising* existingAdvertising) {
 	NimBLEService* pService = pServer->createService("4fafc201-1fb5-459e-2000-c5c9c3319f00");
 	_txCharacteristic = pService->createCharacteristic("4fafc201-1fb5-459e-2000-c5c9c3319a00", NIMBLE_PROPERTY::NOTIFY); // TX
+	_txCharacteristic->setCallbacks(new TxCharacteristicCallbacks(this));
 	_rxCharacteristic = pService->createCharacteristic("4fafc201-1fb5-459e-2000-c5c9c3319b00", NIMBLE_PROPERTY::WRITE | NIMBLE_PROPERTY::WRITE_NR); // RX
 	_rxCharacteristic->setCallbacks(new RxCharacteristicCallbacks(this));
 	pService->start(); // Start the service
@@ -44,15 +51,67 @@ void ArcticOTA::createService(NimBLEAdvertising* existingAdvertising) {
 
 // Updates new data flag
 void ArcticOTA::setNewDataAvailable(bool available, std::string command) {
-	// Process background commands for console
-	ArcticCommand com = ArcticCommand(command);
-	if (com.base() == "ARCTIC_COMMAND_OTA_SETUP") {
-		std::string size_str = com.arg("-s");
-		uint32_t size = std::stoul(size_str);
-		std::string hash_str = com.arg("-md5");
+	// Process background commands, firmware chunks are never parsed
+	if (ArcticCommand::isSystem(command)) {
+		ArcticCommand com(command);
+		if (com.base() == "ARCTIC_COMMAND_OTA_SETUP") {
+			// A missing or bad size stays 0, Update.begin() rejects it and the host gets ERROR
+			uint32_t size = 0;
+			com.get("-s", size);
+			std::string hash_str = com.arg("-md5");
+
+			_ota_setup_size = size;
+			_ota_setup_hash = hash_str;
+
+			// -z <stream size>: the image comes compressed, -s stays the size written to flash
+			_ota_setup_compressed = com.arg("-z", 0u);
+
+			// -base <sha256>: the stream is a patch against the running image
+			_ota_setup_base = com.arg("-base");
+
+			// -file <path> or -part <label>: data instead of firmware, same transfer and checks
+			_ota_setup_target = com.check("-file") ? ARCTIC_OTA_FILE : com.check("-part") ? ARCTIC_OTA_PARTITION : ARCTIC_OTA_FIRMWARE;
+			_ota_setup_name = com.arg(_ota_setup_target == ARCTIC_OTA_FILE ? "-file" : "-part");
 
-		_ota_file_size = size;
-		_ota_file_hash = hash_str;
+			// Windowed transfer when the host gives a window, stop-and-wait otherwise.
+			// Requests are cut to what the device supports, READY tells the host the result.
+			_ota_setup_windowed = com.check("-w");
+			_ota_setup_window = 1;
+			_ota_setup_chunk = ARCTIC_OTA_CHUNK;
+			if (_ota_setup_windowed) {
+				_ota_setup_window = std::max(1u, std::min(com.arg("-w", 1u), (unsigned)ARCTIC_OTA_WINDOW));
+				unsigned limit = ota_chunk_limit();
+				_ota_setup_chunk = std::max((unsigned)ARCTIC_OTA_CHUNK_MIN, std::min(com.arg("-c", limit), limit));
+			}
+			_ota_setup_pending = true;
+		}
+		else if (com.base() == "ARCTIC_COMMAND_OTA_STATS") {
+			ota_send_stats();
+		}
+		else if (com.base() == "ARCTIC_COMMAND_OTA_READ" && !_ota_read_pending.load()) {
+			// The writer task streams the range back, a request while one is served is dropped
+			_ota_read_target = com.check("-part") ? ARCTIC_OTA_PARTITION : ARCTIC_OTA_FILE;
+			_ota_read_name = com.arg(_ota_read_target == ARCTIC_OTA_FILE ? "-file" : "-part");
+			_ota_read_offset = com.arg("-o", 0u);
+			_ota_read_length = com.arg("-n", 0xFFFFFFFFu);
+			unsigned limit = ota_chunk_limit();
+			_ota_read_chunk = std::max((unsigned)ARCTIC_OTA_CHUNK_MIN, std::min(com.arg("-c", limit), limit));
+			if (_ota_started.load() || !ota_start_task()) {
+				ota_send_ack("ERROR");
+			}
+			else {
+				_ota_read_pending = true;
+				xTaskNotifyGive(_ota_task);
+			}
+		}
+	}
+	else {
+		// Chunks go to the writer task, the application is only woken by commands
+		ota_store_chunk(command);
+		if (_ota_task != nullptr) {
+			xTaskNotifyGive(_ota_task);
+		}
+		return;
 	}
 
 	newDataAvailable = available;
@@ -61,42 +120,61 @@ void ArcticOTA::setNewDataAvailable(bool available, std::string command) {
 // Available RX: Check if new data is available
 bool ArcticOTA::available() {
 	if (!ArcticClient::arctic_connection_status) {
-		if (_ota_started) {
+		if (_ota_started && _ota_windowed && !_ota_suspended) {
+			if (_debug_enabled)
+				Serial.println("OTA connection lost, waiting to resume");
+			_ota_suspended = true;
+			_ota_timeout = millis();
+		}
+		if (_ota_started && (!_ota_windowed || millis() - _ota_timeout > ARCTIC_OTA_RESUME_TIMEOUT)) {
 			if (_debug_enabled)
 				Serial.println("OTA connection lost, aborting update");
+			xSemaphoreTake(_ota_mutex, portMAX_DELAY);
+			_ota_timeouts++;
+			ota_target_abort();
 			ota_clear();
+			xSemaphoreGive(_ota_mutex);
 		}
 		return false;
 	}
 
 	// Check OTA state synchronously
 	if (_ota_started) {
+		xSemaphoreTake(_ota_mutex, portMAX_DELAY);
 
 		// Check if OTA update is done
-		if (Update.isFinished()) {
-			if (Update.end()) {
-				if (_md5_started) {
-					_ota_md5.calculate();
-					const char* _ota_md5_str = _ota_md5.toString().c_str();
-				}
+		if (ota_target_finished()) {
+			if (_md5_started) {
+				_ota_md5.calculate();
+				snprintf(_ota_stats.md5, sizeof(_ota_stats.md5), "%s", _ota_md5.toString().c_str());
+			}
+			_ota_stats_end = millis();
+			_ota_stats.verified = ota_target_end();
+			if (_ota_stats.verified && _ota_target == ARCTIC_OTA_FIRMWARE) {
 				ota_send_ack("DONE");
 				_ota_done = true;
+				xSemaphoreGive(_ota_mutex);
 				return true;
 			}
+			else if (_ota_stats.verified) {
+				ota_send_ack("DONE"); // Data doesn't need a restart, the next transfer can start
+			}
 			else {
 				ota_send_ack("ERROR");
 			}
 			ota_clear();
 		}
 
-		// Check if OTA update timed out
-		if (millis() - _ota_timeout > 5000) {
+		// Check if OTA update timed out, a suspended one waits longer for the host to resume it
+		if (millis() - _ota_timeout > (_ota_suspended ? ARCTIC_OTA_RESUME_TIMEOUT : 5000)) {
 			ota_send_ack("TIMEOUT");
-			Update.abort();
+			ota_target_abort();
 			ota_handle_error();
 			ota_clear();
+			xSemaphoreGive(_ota_mutex);
 			return false;
 		}
+		xSemaphoreGive(_ota_mutex);
 	}
 
 	bool available = newDataAvailable.load();
@@ -112,15 +190,61 @@ void ArcticOTA::send(const char* format, ...) {
 	va_list args;
 	va_start(args, format);
 	vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
 
-	if (pServer->getConnectedCount() > 0) {
-		if (_txCharacteristic) {
-			_txCharacteristic->setValue((uint8_t*)buffer, strlen(buffer));
+	// A line longer than one notification goes out in pieces, every piece but the last ends with
+	// ARCTIC_OTA_MORE and the host joins them. At the default MTU END and STATS replies take several.
+	size_t length = strlen(buffer);
+	size_t payload = ArcticClient::mtu() - 3;
+	if (pServer->getConnectedCount() > 0 && _txCharacteristic) {
+		uint8_t piece[sizeof(buffer)];
+		size_t sent = 0;
+		do {
+			size_t size = length - sent;
+			bool more = size > payload;
+			if (more) size = payload - 1;
+			memcpy(piece, buffer + sent, size);
+			sent += size;
+			if (more) piece[size++] = ARCTIC_OTA_MORE;
+			_txCharacteristic->setValue(piece, size);
 			_txCharacteristic->notify();
+			ArcticClient::arctic_tx_bytes += size;
+		} while (sent < length);
+	}
+}
+
+// Stats: Copy of the OTA statistics with the rates computed now. Counters keep moving while
+// an update runs, the copy is not taken at a single instant.
+ArcticOTAStats ArcticOTA::stats() {
+	ArcticOTAStats stats = _ota_stats;
+	stats.chunks = _ota_chunks.load();
+	stats.errors = _ota_errors.load();
+	stats.timeouts = _ota_timeouts.load();
+	if (_ota_stats_start == 0) return stats;
+
+	unsigned long now = millis();
+	stats.elapsed = (_ota_stats_end ? _ota_stats_end : now) - _ota_stats_start;
+	stats.average = stats.elapsed ? (uint32_t)((uint64_t)stats.bytes * 1000 / stats.elapsed) : 0;
+
+	uint32_t step = now / ARCTIC_OTA_RATE_STEP;
+	uint32_t bytes = 0;
+	for (size_t i = 0; i < ARCTIC_OTA_RATE_SLOTS; i++) {
+		if (step - _ota_rate_step[i] < ARCTIC_OTA_RATE_SLOTS) {
+			bytes += _ota_rate[i];
 		}
 	}
+	stats.rate = (uint32_t)((uint64_t)bytes * 1000 / (ARCTIC_OTA_RATE_SLOTS * ARCTIC_OTA_RATE_STEP));
+	return stats;
+}
 
-	va_end(args);
+// Filesystem: Where -file transfers are written and read, LittleFS or SPIFFS once mounted
+void ArcticOTA::filesystem(fs::FS& fs) {
+	_ota_fs = &fs;
+}
+
+// Updates TX status, notify reports its result here while it runs
+void ArcticOTA::setTxStatus(int code) {
+	_ota_tx_status = code;
 }
 
 // Read RX: Read RX data until delimiter
@@ -149,22 +273,106 @@ std::vector<uint8_t> ArcticOTA::raw() {
 bool ArcticOTA::download() {
 	if (!ArcticClient::arctic_connection_status) return false;
 	if (_ota_done) return true;
+	if (!_ota_setup_pending.exchange(false)) return false;
+
+	// The same image again: continue where it stopped. Anything else replaces the update in progress.
+	if (_ota_started) {
+		xSemaphoreTake(_ota_mutex, portMAX_DELAY);
+		bool resumed = ota_resume();
+		if (!resumed) {
+			ota_target_abort();
+			ota_clear();
+		}
+		xSemaphoreGive(_ota_mutex);
+		if (resumed) return false;
+	}
 
 	if (!_ota_started) {
+		_ota_stats = ArcticOTAStats();
+		_ota_chunks = 0;
+		_ota_errors = 0;
+		_ota_timeouts = 0;
+		_ota_stats_start = millis();
+		_ota_stats_end = 0;
+		_ota_unacked = false;
+		memset(_ota_rate, 0, sizeof(_ota_rate));
+		memset(_ota_rate_step, 0, sizeof(_ota_rate_step));
+
 		_ota_timeout = millis();
+		_ota_file_size = _ota_setup_size;
+		_ota_file_hash = _ota_setup_hash;
+		_ota_compressed = _ota_setup_compressed != 0;
+		_ota_transfer_size = _ota_compressed ? _ota_setup_compressed : _ota_setup_size;
+		_ota_delta_base = _ota_setup_base;
+		_ota_target = _ota_setup_target;
+		_ota_target_name = _ota_setup_name;
+		_ota_windowed = _ota_setup_windowed;
+		_ota_window = _ota_setup_window;
+		_ota_chunk = _ota_setup_chunk;
 
-		Update.setMD5(_ota_file_hash.c_str());
-		if (!Update.begin(_ota_file_size)) {
+		ota_start_task();
+
+		// A patch is only sent compressed, for firmware, and only applies to the image it was made for.
+		// MISMATCH tells the host to send the whole image instead.
+		bool firmware = _ota_target == ARCTIC_OTA_FIRMWARE;
+		if (!_ota_delta_base.empty() && (!firmware || !_ota_compressed || !ota_base_matches())) {
+			ota_send_ack(firmware && _ota_compressed ? "MISMATCH" : "ERROR");
+			ota_clear();
+			return false;
+		}
+
+		if (!ota_target_begin()) {
 			ota_send_ack("ERROR");
 			ota_handle_error();
 			ota_clear();
 			return false;
 		}
-		ota_send_ack("READY");
+
+		// Slots are kept after the update, a late RX callback may still be copying into them
+		size_t slots = (size_t)_ota_window * _ota_chunk;
+		if (_ota_slots_size < slots) {
+			delete[] _ota_slots;
+			_ota_slots = new (std::nothrow) uint8_t[slots];
+			_ota_slots_size = _ota_slots ? slots : 0;
+		}
+		if (_ota_batch == nullptr) {
+			_ota_batch = new (std::nothrow) uint8_t[ARCTIC_OTA_BATCH];
+		}
+		if (_ota_compressed && _ota_decoder == nullptr) {
+			_ota_decoder = new (std::nothrow) ArcticLZDecoder();
+		}
+		if (_ota_decoder != nullptr) {
+			_ota_decoder->reset();
+		}
+		bool delta = !_ota_delta_base.empty();
+		if (delta && _ota_delta == nullptr) {
+			_ota_delta = new (std::nothrow) ArcticDeltaDecoder();
+			_ota_patch = new (std::nothrow) uint8_t[ARCTIC_OTA_PATCH];
+		}
+		if (delta && _ota_delta != nullptr) {
+			const esp_partition_t* running = esp_ota_get_running_partition();
+			_ota_delta->reset(running->size, [running](uint32_t offset, uint8_t* data, size_t length) {
+				return esp_partition_read(running, offset, data, length) == ESP_OK;
+			});
+		}
+		_ota_patch_length = 0;
+		_ota_patch_taken = 0;
+		if (_ota_slots == nullptr || _ota_batch == nullptr || _ota_task == nullptr || (_ota_compressed && _ota_decoder == nullptr) || (delta && (_ota_delta == nullptr || _ota_patch == nullptr))) {
+			ota_target_abort();
+			ota_send_ack("ERROR");
+			ota_clear();
+			return false;
+		}
+		for (size_t i = 0; i < ARCTIC_OTA_WINDOW_MAX; i++) {
+			_ota_slot_offset[i] = ARCTIC_OTA_FREE;
+		}
+		_ota_next = 0;
+		_ota_arrival = 0;
+		_ota_ack_request = false;
+		_ota_batch_length = 0;
+		_ota_taken = 0;
 		_ota_started = true;
-	}
-	else {
-		ota_digest_chunk();
+		ota_send_ready();
 	}
 	return false;
 }
@@ -177,20 +385,447 @@ void ArcticOTA::show() {
 	send("ARCTIC_COMMAND_SHOW");
 }
 
-// Digest OTA chunk
+// Store OTA chunk: Copy a chunk into its window slot from the RX callback, before the next write replaces it
+void ArcticOTA::ota_store_chunk(const std::string& data) {
+	if (!_ota_started.load() || _ota_slots == nullptr) return;
+	uint32_t now = micros();
+	if (_ota_chunks++ > 0) {
+		ota_count_time(_ota_stats.arrival, now - _ota_last_arrival);
+	}
+	_ota_last_arrival = now;
+
+	const uint8_t* bytes = (const uint8_t*)data.data();
+	size_t length = data.size();
+	uint32_t offset = _ota_arrival;
+	if (_ota_windowed) {
+		if (length <= ARCTIC_OTA_OFFSET) return;
+		offset = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+		bytes += ARCTIC_OTA_OFFSET;
+		length -= ARCTIC_OTA_OFFSET;
+		if (offset % _ota_chunk) {
+			_ota_stats.rejected++;
+			return;
+		}
+	}
+	if (length == 0 || length > _ota_chunk || offset + length > _ota_transfer_size) {
+		_ota_stats.rejected++;
+		return;
+	}
+
+	// Already written: the host missed an ACK, send it again
+	uint32_t next = _ota_next.load();
+	if (offset < next) {
+		_ota_stats.retransmits++;
+		_ota_ack_request = true;
+		return;
+	}
+	if (offset - next >= (uint32_t)_ota_window * _ota_chunk) {
+		_ota_stats.rejected++;
+		return;
+	}
+
+	// A busy slot already holds this chunk, a retransmission
+	size_t slot = (offset / _ota_chunk) % _ota_window;
+	if (_ota_slot_offset[slot].load(std::memory_order_acquire) != ARCTIC_OTA_FREE) {
+		_ota_stats.retransmits++;
+		return;
+	}
+	memcpy(_ota_slots + slot * _ota_chunk, bytes, length);
+	_ota_slot_length[slot] = length;
+	_ota_slot_time[slot] = now;
+	_ota_slot_offset[slot].store(offset, std::memory_order_release);
+	if (!_ota_windowed) {
+		_ota_arrival += length;
+	}
+}
+
+// Resume: Continue the update in progress if the setup is for the same image, from the last chunk taken.
+// Chunks still in the slots are dropped, the host sends them again.
+bool ArcticOTA::ota_resume() {
+	if (!_ota_windowed || !_ota_setup_windowed) return false;
+	if (_ota_setup_size != _ota_file_size || _ota_setup_hash != _ota_file_hash || _ota_setup_hash.empty()) return false;
+	if (_ota_setup_compressed != (_ota_compressed ? _ota_transfer_size : 0) || _ota_setup_base != _ota_delta_base) return false;
+	if (_ota_setup_target != _ota_target || _ota_setup_name != _ota_target_name) return false;
+
+	// Offsets already sent are multiples of the chunk size, it can't change. The window can, within the slots.
+	if ((size_t)_ota_setup_window * _ota_chunk <= _ota_slots_size) {
+		_ota_window = _ota_setup_window;
+	}
+	for (size_t i = 0; i < ARCTIC_OTA_WINDOW_MAX; i++) {
+		_ota_slot_offset[i] = ARCTIC_OTA_FREE;
+	}
+	_ota_ack_request = false;
+	_ota_suspended = false;
+	_ota_unacked = false;
+	_ota_stats.resumes++;
+	_ota_timeout = millis();
+	if (_debug_enabled)
+		Serial.printf("OTA resumed at %lu\n", (unsigned long)_ota_next.load());
+	ota_send_ready();
+	return true;
+}
+
+// Base matches: Check the running image against the SHA-256 the patch was made for
+bool ArcticOTA::ota_base_matches() {
+	uint8_t sha[32];
+	if (esp_partition_get_sha256(esp_ota_get_running_partition(), sha) != ESP_OK) return false;
+	char hex[65];
+	for (int i = 0; i < 32; i++) {
+		snprintf(hex + i * 2, 3, "%02x", sha[i]);
+	}
+	return strcasecmp(hex, _ota_delta_base.c_str()) == 0;
+}
+
+// Send READY: READY[n] in stop-and-wait, READY[n]:<window>,<chunk>,<resume offset> in windowed mode
+void ArcticOTA::ota_send_ready() {
+	if (!_ota_windowed) {
+		ota_send_ack("READY");
+		return;
+	}
+	if (_debug_enabled)
+		Serial.printf("READY[%d]:%u,%u,%lu\n", _ack_counter, (unsigned)_ota_window, (unsigned)_ota_chunk, (unsigned long)_ota_next.load());
+	send("READY[%d]:%u,%u,%lu", _ack_counter, (unsigned)_ota_window, (unsigned)_ota_chunk, (unsigned long)_ota_next.load());
+	_ack_counter++;
+}
+
+// Start task: The writer task is created by the first transfer or read and kept
+bool ArcticOTA::ota_start_task() {
+	xSemaphoreTake(_ota_mutex, portMAX_DELAY);
+	if (_ota_task == nullptr) {
+		xTaskCreate(ota_writer_task, "arctic_ota", ARCTIC_OTA_TASK_STACK, this, ARCTIC_OTA_TASK_PRIORITY, &_ota_task);
+	}
+	xSemaphoreGive(_ota_mutex);
+	return _ota_task != nullptr;
+}
+
+// Writer task: Sleep until the RX callback stores a chunk, then move chunks to flash
+void ArcticOTA::ota_writer_task(void* parameter) {
+	ArcticOTA* ota = static_cast<ArcticOTA*>(parameter);
+	while (true) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		xSemaphoreTake(ota->_ota_mutex, portMAX_DELAY);
+		if (ota->_ota_started) {
+			ota->ota_digest_chunk();
+		}
+		else if (ota->_ota_read_pending) {
+			ota->ota_read_back();
+		}
+		xSemaphoreGive(ota->_ota_mutex);
+	}
+}
+
+// Digest OTA chunk: Gather the stored chunks that continue the image into the sector buffer.
+// They are acknowledged before each flash write and at the end, a chunk is only split at a sector end.
 void ArcticOTA::ota_digest_chunk() {
-	std::vector<uint8_t> ota_bytes = raw();
 	_ota_timeout = millis(); // Reset timeout
 	if (!_md5_started) {
 		_ota_md5.begin();
 		_md5_started = true;
 	}
-	_ota_md5.add(ota_bytes.data(), ota_bytes.size());
-	size_t written = Update.write(ota_bytes.data(), ota_bytes.size());
-	if (written != ota_bytes.size()) {
-		// Error writing OTA chunk
+
+	bool progress = false;
+	while (true) {
+		uint32_t next = _ota_next.load();
+		size_t slot = (next / _ota_chunk) % _ota_window;
+		if (_ota_slot_offset[slot].load(std::memory_order_acquire) != next) break;
+
+		size_t length = _ota_slot_length[slot] - _ota_taken;
+		size_t taken = ota_take_chunk(_ota_slots + slot * _ota_chunk + _ota_taken, length);
+		if (taken == 0 && length > 0 && _ota_batch_length < ARCTIC_OTA_BATCH) {
+			ota_fail(); // The stream is corrupt or decodes past the image size
+			return;
+		}
+		_ota_taken += taken;
+
+		// Free the slot before moving the window, the callback checks them in the other order
+		if (_ota_taken == _ota_slot_length[slot]) {
+			if (!_ota_unacked) {
+				_ota_unacked_since = _ota_slot_time[slot];
+				_ota_unacked = true;
+			}
+			_ota_stats.bytes += _ota_taken;
+			ota_count_rate(_ota_taken);
+			_ota_slot_offset[slot].store(ARCTIC_OTA_FREE, std::memory_order_release);
+			_ota_next.store(next + _ota_taken);
+			_ota_taken = 0;
+			progress = true;
+		}
+
+		bool last = _ota_next.load() == _ota_transfer_size;
+		if (_ota_batch_length == ARCTIC_OTA_BATCH || last) {
+			if (progress) {
+				ota_acknowledge();
+				progress = false;
+			}
+			if (!ota_flush_batch()) return;
+
+			// The end of the stream can still hold a match that didn't fit the last sector
+			while (last && _ota_compressed) {
+				ota_take_chunk(nullptr, 0);
+				if (_ota_batch_length == 0) break;
+				if (!ota_flush_batch()) return;
+			}
+			if (last && _ota_compressed && !ota_target_finished()) {
+				ota_fail(); // The stream ended before the image
+				return;
+			}
+		}
+	}
+
+	if (progress || _ota_ack_request.load()) {
+		ota_acknowledge();
+	}
+}
+
+// Take chunk: Move stored bytes into the sector buffer, through the decoder for a compressed image.
+// Returns the stored bytes used, output never goes past the image size.
+size_t ArcticOTA::ota_take_chunk(const uint8_t* data, size_t length) {
+	uint8_t* out = _ota_batch + _ota_batch_length;
+	size_t room = ARCTIC_OTA_BATCH - _ota_batch_length;
+	if (!_ota_compressed) {
+		room = std::min(room, length);
+		memcpy(out, data, room);
+		uint32_t start = micros();
+		_ota_md5.add(out, room);
+		_ota_stats.hashTime += micros() - start;
+		_ota_batch_length += room;
+		return room;
+	}
+
+	size_t consumed = 0;
+	size_t produced = 0;
+	uint32_t start = micros();
+	room = std::min(room, ota_target_remaining() - _ota_batch_length);
+	if (_ota_delta_base.empty()) {
+		produced = _ota_decoder->decompress(data, length, consumed, out, room);
+	}
+
+	// Delta: the stream decodes to the patch, the patch and the running image to the new image
+	while (!_ota_delta_base.empty() && produced < room && !_ota_decoder->error() && !_ota_delta->error()) {
+		size_t used = 0;
+		if (_ota_patch_taken == _ota_patch_length) {
+			_ota_patch_length = _ota_decoder->decompress(data + consumed, length - consumed, used, _ota_patch, ARCTIC_OTA_PATCH);
+			_ota_patch_taken = 0;
+			consumed += used;
+			if (_ota_patch_length == 0) break;
+		}
+		produced += _ota_delta->decode(_ota_patch + _ota_patch_taken, _ota_patch_length - _ota_patch_taken, used, out + produced, room - produced);
+		_ota_patch_taken += used;
+	}
+	uint32_t decoded = micros();
+	_ota_md5.add(out, produced);
+	_ota_stats.decodeTime += decoded - start;
+	_ota_stats.hashTime += micros() - decoded;
+	_ota_batch_length += produced;
+	return (_ota_decoder->error() || (!_ota_delta_base.empty() && _ota_delta->error())) ? 0 : consumed;
+}
+
+// Flush batch: Write the sector buffer, abort the update if flash refuses it
+bool ArcticOTA::ota_flush_batch() {
+	size_t length = _ota_batch_length;
+	_ota_batch_length = 0;
+	if (length == 0) return true;
+
+	uint32_t start = micros();
+	size_t written = ota_target_write(_ota_batch, length);
+	_ota_stats.writeTime += micros() - start;
+	_ota_stats.writes++;
+	_ota_stats.written += written;
+	if (written == length) return true;
+
+	ota_fail();
+	return false;
+}
+
+// Fail: Report the error to the host and drop the update
+void ArcticOTA::ota_fail() {
+	ota_send_ack("ERROR");
+	ota_handle_error();
+	ota_target_abort();
+	ota_clear();
+}
+
+// Target begin: Open what the transfer writes to, the firmware through Update, a file or a data partition
+bool ArcticOTA::ota_target_begin() {
+	_ota_target_written = 0;
+	switch (_ota_target) {
+	case ARCTIC_OTA_FILE: {
+		if (_ota_fs == nullptr || _ota_file_size == 0 || _ota_target_name.empty()) return false;
+		std::string temp = _ota_target_name + ARCTIC_OTA_TEMP;
+		_ota_file = _ota_fs->open(temp.c_str(), "w");
+		return (bool)_ota_file;
+	}
+	case ARCTIC_OTA_PARTITION:
+		_ota_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, _ota_target_name.c_str());
+		return _ota_partition != nullptr && _ota_file_size > 0 && _ota_file_size <= _ota_partition->size;
+	default:
+		Update.setMD5(_ota_file_hash.c_str());
+		return Update.begin(_ota_file_size);
+	}
+}
+
+// Target write: Write a batch, a partition sector is erased right before it is written.
+// Batches start on sector boundaries, only the last one is shorter.
+size_t ArcticOTA::ota_target_write(uint8_t* data, size_t length) {
+	size_t written = 0;
+	switch (_ota_target) {
+	case ARCTIC_OTA_FILE:
+		written = _ota_file.write(data, length);
+		break;
+	case ARCTIC_OTA_PARTITION: {
+		size_t erase = (length + ARCTIC_OTA_BATCH - 1) / ARCTIC_OTA_BATCH * ARCTIC_OTA_BATCH;
+		if (esp_partition_erase_range(_ota_partition, _ota_target_written, erase) == ESP_OK &&
+			esp_partition_write(_ota_partition, _ota_target_written, data, length) == ESP_OK) {
+			written = length;
+		}
+		break;
+	}
+	default:
+		return Update.write(data, length);
+	}
+	_ota_target_written += written;
+	return written;
+}
+
+// Target remaining: Bytes still expected
+size_t ArcticOTA::ota_target_remaining() {
+	if (_ota_target == ARCTIC_OTA_FIRMWARE) return Update.remaining();
+	return _ota_file_size - _ota_target_written;
+}
+
+// Target finished: Every byte was written
+bool ArcticOTA::ota_target_finished() {
+	if (_ota_target == ARCTIC_OTA_FIRMWARE) return Update.isFinished();
+	return _ota_target_written == _ota_file_size;
+}
+
+// Target end: Check the MD5 of what was written, Update.end() does it for the firmware.
+// A file replaces the previous one only when it matches.
+bool ArcticOTA::ota_target_end() {
+	if (_ota_target == ARCTIC_OTA_FIRMWARE) return Update.end();
+
+	bool valid = strcasecmp(_ota_stats.md5, _ota_file_hash.c_str()) == 0;
+	if (_ota_target == ARCTIC_OTA_FILE) {
+		std::string temp = _ota_target_name + ARCTIC_OTA_TEMP;
+		_ota_file.close();
+		if (valid) {
+			_ota_fs->remove(_ota_target_name.c_str());
+			valid = _ota_fs->rename(temp.c_str(), _ota_target_name.c_str());
+		}
+		if (!valid) {
+			_ota_fs->remove(temp.c_str());
+		}
+	}
+	return valid;
+}
+
+// Target abort: Drop the transfer, a partition keeps what was already written
+void ArcticOTA::ota_target_abort() {
+	if (_ota_target == ARCTIC_OTA_FIRMWARE) {
+		Update.abort();
+	}
+	else if (_ota_target == ARCTIC_OTA_FILE && _ota_file) {
+		_ota_file.close();
+		_ota_fs->remove((_ota_target_name + ARCTIC_OTA_TEMP).c_str());
+	}
+}
+
+// Read back: Stream a range of a file or data partition to the host as [offset u32 LE][data]
+// notifications, then END[n]:<offset>,<length>,<md5> for the bytes sent
+void ArcticOTA::ota_read_back() {
+	uint32_t offset = _ota_read_offset;
+	uint32_t size = 0;
+	fs::File file;
+	const esp_partition_t* partition = nullptr;
+	if (_ota_read_target == ARCTIC_OTA_FILE && _ota_fs != nullptr && !_ota_read_name.empty()) {
+		file = _ota_fs->open(_ota_read_name.c_str(), "r");
+		size = file ? file.size() : 0;
+		if (file && offset < size) {
+			file.seek(offset);
+		}
+	}
+	else if (_ota_read_target == ARCTIC_OTA_PARTITION) {
+		partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, _ota_read_name.c_str());
+		size = partition ? partition->size : 0;
+	}
+	if ((!file && partition == nullptr) || offset > size) {
+		_ota_read_pending = false;
+		ota_send_ack("ERROR");
+		return;
+	}
+
+	uint32_t end = offset + std::min(_ota_read_length, size - offset);
+	uint8_t packet[ARCTIC_OTA_CHUNK];
+	MD5Builder md5;
+	md5.begin();
+	while (offset < end && ArcticClient::arctic_connection_status) {
+		size_t length = std::min((uint32_t)_ota_read_chunk, end - offset);
+		uint8_t* data = packet + ARCTIC_OTA_OFFSET;
+		bool read = file ? file.read(data, length) == length : esp_partition_read(partition, offset, data, length) == ESP_OK;
+		packet[0] = offset & 0xFF;
+		packet[1] = (offset >> 8) & 0xFF;
+		packet[2] = (offset >> 16) & 0xFF;
+		packet[3] = offset >> 24;
+		if (!read || !ota_notify(packet, length + ARCTIC_OTA_OFFSET)) break;
+		md5.add(data, length);
+		offset += length;
+	}
+	if (file) {
+		file.close();
+	}
+
+	md5.calculate();
+	_ota_read_pending = false;
+	send("END[%d]:%lu,%lu,%s", _ack_counter, (unsigned long)_ota_read_offset, (unsigned long)(offset - _ota_read_offset), md5.toString().c_str());
+	_ack_counter++;
+}
+
+// Notify: Send one read back notification, waiting for the stack while it has no buffer left
+bool ArcticOTA::ota_notify(const uint8_t* data, size_t length) {
+	for (int retry = 0; retry < ARCTIC_OTA_READ_RETRIES; retry++) {
+		if (!ArcticClient::arctic_connection_status || pServer->getConnectedCount() == 0) return false;
+		_ota_tx_status = 0;
+		_txCharacteristic->setValue(data, length);
+		_txCharacteristic->notify(true);
+		if (_ota_tx_status == 0) {
+			ArcticClient::arctic_tx_bytes += length;
+			return true;
+		}
+		vTaskDelay(1);
+	}
+	return false;
+}
+
+// Acknowledge: Tell the host how far the image arrived
+void ArcticOTA::ota_acknowledge() {
+	_ota_ack_request = false;
+	if (_ota_unacked) {
+		ota_count_time(_ota_stats.turnaround, micros() - _ota_unacked_since);
+		_ota_unacked = false;
+	}
+	_ota_stats.acks++;
+	if (_ota_windowed) {
+		ota_send_window_ack();
+	}
+	else {
+		ota_send_ack("ACK");
+	}
+}
+
+// Send window ACK: ACK[n]:<next offset>,<bitmap>, bit i set when the chunk i + 1 chunks past next arrived
+void ArcticOTA::ota_send_window_ack() {
+	uint32_t next = _ota_next.load();
+	uint32_t received = 0;
+	for (size_t i = 1; i < _ota_window; i++) {
+		uint32_t offset = next + i * _ota_chunk;
+		if (_ota_slot_offset[(offset / _ota_chunk) % _ota_window].load(std::memory_order_acquire) == offset) {
+			received |= 1UL << (i - 1);
+		}
 	}
-	ota_send_ack("ACK");
+	if (_debug_enabled)
+		Serial.printf("ACK[%d]:%lu,%lx\n", _ack_counter, (unsigned long)next, (unsigned long)received);
+	send("ACK[%d]:%lu,%lx", _ack_counter, (unsigned long)next, (unsigned long)received);
+	_ack_counter++;
 }
 
 // Handle OTA errors
@@ -225,6 +860,13 @@ void ArcticOTA::ota_send_ack(const char* ack) {
 		Serial.printf("%s[%d]\n", ack, _ack_counter);
 	send("%s[%d]", ack, _ack_counter);
 	_ack_counter++;
+
+	if (strcmp(ack, "ERROR") == 0) {
+		_ota_errors++;
+	}
+	else if (strcmp(ack, "TIMEOUT") == 0) {
+		_ota_timeouts++;
+	}
 }
 
 // Clear OTA variables
@@ -234,4 +876,55 @@ void ArcticOTA::ota_clear() {
 	_md5_started = false;
 	_ota_timeout = 0;
 	_ack_counter = 0;
+	_ota_suspended = false;
+	if (_ota_stats_end == 0) {
+		_ota_stats_end = millis();
+	}
+}
+
+// Send stats: Reply to ARCTIC_COMMAND_OTA_STATS on the OTA TX, one line per group
+void ArcticOTA::ota_send_stats() {
+	ArcticOTAStats s = stats();
+	send("STATS:%lu,%lu,%lu,%lu,%lu", (unsigned long)s.bytes, (unsigned long)s.written, (unsigned long)s.elapsed, (unsigned long)s.rate, (unsigned long)s.average);
+	send("LINK:%lu,%lu,%lu,%lu,%lu,%lu,%lu", (unsigned long)s.chunks, (unsigned long)s.retransmits, (unsigned long)s.rejected, (unsigned long)s.acks, (unsigned long)s.resumes, (unsigned long)s.timeouts, (unsigned long)s.errors);
+	send("TIME:%lu,%lu,%lu,%lu", (unsigned long)s.writes, (unsigned long)s.writeTime, (unsigned long)s.hashTime, (unsigned long)s.decodeTime);
+
+	const char* names[2] = {"ARRIVAL", "TURNAROUND"};
+	const uint32_t* histograms[2] = {s.arrival, s.turnaround};
+	for (int h = 0; h < 2; h++) {
+		char line[160];
+		int length = snprintf(line, sizeof(line), "%s:", names[h]);
+		for (int i = 0; i < ARCTIC_OTA_HISTOGRAM; i++) {
+			length += snprintf(line + length, sizeof(line) - length, i ? ",%lu" : "%lu", (unsigned long)histograms[h][i]);
+		}
+		send("%s", line);
+	}
+	send("MD5:%s,%d", s.md5, s.verified ? 1 : 0);
+}
+
+// Chunk limit: Largest windowed chunk, with its offset it must fit one ATT write at the negotiated MTU.
+// It is also the default when the host doesn't ask for a chunk size.
+unsigned ArcticOTA::ota_chunk_limit() {
+	unsigned payload = std::min((unsigned)ArcticClient::mtu() - 3, (unsigned)ARCTIC_OTA_CHUNK);
+	return std::max((unsigned)ARCTIC_OTA_CHUNK_MIN, payload - ARCTIC_OTA_OFFSET);
+}
+
+// Count rate: Add bytes to the current throughput step, steps older than the window are reused
+void ArcticOTA::ota_count_rate(uint32_t bytes) {
+	uint32_t step = millis() / ARCTIC_OTA_RATE_STEP;
+	size_t slot = step % ARCTIC_OTA_RATE_SLOTS;
+	if (_ota_rate_step[slot] != step) {
+		_ota_rate_step[slot] = step;
+		_ota_rate[slot] = 0;
+	}
+	_ota_rate[slot] += bytes;
+}
+
+// Count time: Add a time in us to its histogram bucket
+void ArcticOTA::ota_count_time(uint32_t* histogram, uint32_t time) {
+	size_t bucket = 0;
+	while (bucket < ARCTIC_OTA_HISTOGRAM - 1 && time >= ((uint32_t)ARCTIC_OTA_HISTOGRAM_BASE << bucket)) {
+		bucket++;
+	}
+	histogram[bucket]++;
 }
\ No newline at end of file
@@ -19,12 +19,108 @@
 #pragma once
 
 #include <atomic>
+#include <new>
 #include <string>
 #include <vector>
 
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include <FS.h>
 #include <MD5Builder.h>
 #include <NimBLEDevice.h>
 #include <Update.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+
+#include <ArcticDelta.h>
+#include <ArcticLZ.h>
+
+// Largest OTA chunk, an ATT write can't carry more
+#ifndef ARCTIC_OTA_CHUNK
+#define ARCTIC_OTA_CHUNK 512
+#endif
+
+// Windowed OTA: most chunks the host may have in flight, the ACK bitmap holds one bit per chunk
+#ifndef ARCTIC_OTA_WINDOW
+#define ARCTIC_OTA_WINDOW 16
+#endif
+#define ARCTIC_OTA_WINDOW_MAX 32
+static_assert(ARCTIC_OTA_WINDOW > 0 && ARCTIC_OTA_WINDOW <= ARCTIC_OTA_WINDOW_MAX, "ARCTIC_OTA_WINDOW must be between 1 and ARCTIC_OTA_WINDOW_MAX (32)");
+
+// Windowed OTA chunk: [offset u32 LE][data], offsets are multiples of the chunk size
+#define ARCTIC_OTA_OFFSET 4
+#define ARCTIC_OTA_CHUNK_MIN 16
+#define ARCTIC_OTA_FREE 0xFFFFFFFF
+
+// Last byte of an OTA reply notification continued in the next one
+#define ARCTIC_OTA_MORE '~'
+
+// Time (ms) an interrupted windowed update waits for the host to reconnect and resume it
+#ifndef ARCTIC_OTA_RESUME_TIMEOUT
+#define ARCTIC_OTA_RESUME_TIMEOUT 120000
+#endif
+
+// Chunks are gathered into flash sector sized writes
+#define ARCTIC_OTA_BATCH 4096
+
+// Transfer targets, chosen by OTA_SETUP: the firmware, -file <path> on the filesystem given to
+// filesystem() or -part <label>, a data partition
+#define ARCTIC_OTA_FIRMWARE 0
+#define ARCTIC_OTA_FILE 1
+#define ARCTIC_OTA_PARTITION 2
+
+// A file is received under its name with this suffix and renamed once its MD5 matches
+#define ARCTIC_OTA_TEMP ".part"
+
+// Read back: a notification the stack refuses is tried again this many times, a tick apart
+#define ARCTIC_OTA_READ_RETRIES 50
+
+// Delta OTA: patch bytes decompressed at once, between the stream and the patch decoder
+#define ARCTIC_OTA_PATCH 256
+
+// OTA statistics: throughput over ARCTIC_OTA_RATE_SLOTS steps of ARCTIC_OTA_RATE_STEP ms
+#ifndef ARCTIC_OTA_RATE_STEP
+#define ARCTIC_OTA_RATE_STEP 250
+#endif
+#define ARCTIC_OTA_RATE_SLOTS 8
+
+// Histogram bucket i counts times under ARCTIC_OTA_HISTOGRAM_BASE << i us, the last one all longer times
+#define ARCTIC_OTA_HISTOGRAM 12
+#define ARCTIC_OTA_HISTOGRAM_BASE 250
+
+// Statistics of the update in progress or the last one, reset when an update starts
+struct ArcticOTAStats {
+	uint32_t bytes = 0;       // Transfer bytes taken in order
+	uint32_t written = 0;     // Image bytes written to flash
+	uint32_t elapsed = 0;     // ms since the start, until the end
+	uint32_t rate = 0;        // Bytes per second over the last ARCTIC_OTA_RATE_SLOTS steps
+	uint32_t average = 0;     // Bytes per second since the start
+	uint32_t chunks = 0;      // Chunks received, retransmissions included
+	uint32_t retransmits = 0; // Chunks already written or buffered
+	uint32_t rejected = 0;    // Chunks outside the window or the transfer
+	uint32_t acks = 0;
+	uint32_t resumes = 0;
+	uint32_t timeouts = 0;
+	uint32_t errors = 0;
+	uint32_t writes = 0;     // Update.write() calls
+	uint32_t writeTime = 0;  // us spent in Update.write()
+	uint32_t hashTime = 0;   // us spent hashing the image
+	uint32_t decodeTime = 0; // us spent decompressing and patching
+	uint32_t arrival[ARCTIC_OTA_HISTOGRAM] = {};    // Time between two chunks
+	uint32_t turnaround[ARCTIC_OTA_HISTOGRAM] = {}; // Time from a chunk to the ACK covering it
+	char md5[33] = "";                              // MD5 of the image written, once complete
+	bool verified = false;                          // Update.end() accepted the image
+};
+
+// Task moving chunks from the window to flash
+#ifndef ARCTIC_OTA_TASK_STACK
+#define ARCTIC_OTA_TASK_STACK 4096
+#endif
+#ifndef ARCTIC_OTA_TASK_PRIORITY
+#define ARCTIC_OTA_TASK_PRIORITY 2
+#endif
 
 class ArcticOTA {
 public:
@@ -37,9 +133,12 @@ public:
 	void send(const char* format, ...);
 	std::string read(char delimiter = '\n');
 	std::vector<uint8_t> raw();
+	ArcticOTAStats stats();
+	void filesystem(fs::FS& fs);
 
 	void createService(NimBLEAdvertising* existingAdvertising);
 	void setNewDataAvailable(bool available, std::string command);
+	void setTxStatus(int code);
 	NimBLECharacteristic* _txCharacteristic;
 	NimBLECharacteristic* _rxCharacteristic;
 
@@ -51,7 +150,7 @@ private:
 	std::atomic<bool> newDataAvailable{false};
 
 	// OTA variables
-	bool _ota_started = false;
+	std::atomic<bool> _ota_started{false};
 	bool _ota_done = false;
 	bool _md5_started = false;
 	unsigned long _ota_timeout = 0;
@@ -60,9 +159,117 @@ private:
 	uint32_t _ota_file_size = 0;
 	std::string _ota_file_hash = "";
 
+	// Compressed update: the host sends an ArcticLZ stream of _ota_transfer_size bytes, offsets and ACKs
+	// count stream bytes, size and MD5 are checked on the decompressed image
+	uint32_t _ota_transfer_size = 0;
+	ArcticLZDecoder* _ota_decoder = nullptr;
+	bool _ota_compressed = false;
+
+	// Delta update: the stream decodes to a patch, which rebuilds the image from the running partition.
+	// _ota_delta_base is the SHA-256 of the running image the patch was made for, empty otherwise.
+	std::string _ota_delta_base = "";
+	ArcticDeltaDecoder* _ota_delta = nullptr;
+	uint8_t* _ota_patch = nullptr;
+	size_t _ota_patch_length = 0;
+	size_t _ota_patch_taken = 0;
+
+	// Target of the transfer, a file is written as <path>ARCTIC_OTA_TEMP until it is complete
+	uint8_t _ota_target = ARCTIC_OTA_FIRMWARE;
+	std::string _ota_target_name = "";
+	uint32_t _ota_target_written = 0;
+	fs::FS* _ota_fs = nullptr;
+	fs::File _ota_file;
+	const esp_partition_t* _ota_partition = nullptr;
+
+	// Read back, requested by the RX callback and served by the writer task
+	std::atomic<bool> _ota_read_pending{false};
+	uint8_t _ota_read_target = ARCTIC_OTA_FILE;
+	std::string _ota_read_name = "";
+	uint32_t _ota_read_offset = 0;
+	uint32_t _ota_read_length = 0;
+	uint16_t _ota_read_chunk = ARCTIC_OTA_CHUNK_MIN;
+	volatile int _ota_tx_status = 0;
+
+	// Last OTA_SETUP, applied by download(): it starts, restarts or resumes the update
+	std::atomic<bool> _ota_setup_pending{false};
+	uint32_t _ota_setup_size = 0;
+	uint32_t _ota_setup_compressed = 0;
+	std::string _ota_setup_hash = "";
+	std::string _ota_setup_base = "";
+	uint8_t _ota_setup_target = ARCTIC_OTA_FIRMWARE;
+	std::string _ota_setup_name = "";
+	bool _ota_setup_windowed = false;
+	uint8_t _ota_setup_window = 1;
+	uint16_t _ota_setup_chunk = ARCTIC_OTA_CHUNK;
+
+	// A windowed update survives a disconnect: Update stays open and the hash keeps its state in RAM,
+	// the host resumes from the offset sent in READY. It can't survive a reset, Update can't reopen.
+	bool _ota_suspended = false;
+
+	// Chunks are stored in slots by the RX callback and written in order by download(). In the
+	// legacy stop-and-wait protocol the window is 1 and offsets follow the arrival order.
+	bool _ota_windowed = false;
+	uint8_t _ota_window = 1;
+	uint16_t _ota_chunk = ARCTIC_OTA_CHUNK;
+	uint8_t* _ota_slots = nullptr;
+	size_t _ota_slots_size = 0;
+	uint16_t _ota_slot_length[ARCTIC_OTA_WINDOW_MAX];
+	std::atomic<uint32_t> _ota_slot_offset[ARCTIC_OTA_WINDOW_MAX];
+	std::atomic<uint32_t> _ota_next{0};
+	uint32_t _ota_arrival = 0;
+	std::atomic<bool> _ota_ack_request{false};
+
+	// Writer stage: the task takes chunks from the slots into a sector buffer, hashing them on the way,
+	// and acknowledges them before writing the sector so the host keeps sending during the flash write.
+	// The mutex keeps download() and available() from touching Update while it writes.
+	uint8_t* _ota_batch = nullptr;
+	size_t _ota_batch_length = 0;
+	size_t _ota_taken = 0;
+	TaskHandle_t _ota_task = nullptr;
+	SemaphoreHandle_t _ota_mutex = nullptr;
+
+	// Statistics, the counters in _ota_stats have a single writer: the RX callback or the writer task.
+	// Errors and timeouts are reported from every task and chunks are reset by download() while the
+	// RX callback counts them, those are atomic and copied in by stats().
+	ArcticOTAStats _ota_stats;
+	std::atomic<uint32_t> _ota_chunks{0};
+	std::atomic<uint32_t> _ota_errors{0};
+	std::atomic<uint32_t> _ota_timeouts{0};
+	unsigned long _ota_stats_start = 0;
+	unsigned long _ota_stats_end = 0;
+	uint32_t _ota_last_arrival = 0;
+	uint32_t _ota_slot_time[ARCTIC_OTA_WINDOW_MAX];
+	uint32_t _ota_unacked_since = 0;
+	bool _ota_unacked = false;
+	uint32_t _ota_rate[ARCTIC_OTA_RATE_SLOTS];
+	uint32_t _ota_rate_step[ARCTIC_OTA_RATE_SLOTS];
+
 	// OTA functions
+	static void ota_writer_task(void* parameter);
+	bool ota_start_task();
+	bool ota_target_begin();
+	size_t ota_target_write(uint8_t* data, size_t length);
+	size_t ota_target_remaining();
+	bool ota_target_finished();
+	bool ota_target_end();
+	void ota_target_abort();
+	void ota_read_back();
+	bool ota_notify(const uint8_t* data, size_t length);
+	void ota_store_chunk(const std::string& data);
 	void ota_digest_chunk();
+	size_t ota_take_chunk(const uint8_t* data, size_t length);
+	bool ota_flush_batch();
+	void ota_fail();
+	void ota_acknowledge();
+	void ota_send_window_ack();
+	void ota_send_ready();
+	bool ota_resume();
+	bool ota_base_matches();
 	void ota_handle_error();
 	void ota_send_ack(const char* ack);
 	void ota_clear();
+	static unsigned ota_chunk_limit();
+	void ota_send_stats();
+	void ota_count_rate(uint32_t bytes);
+	static void ota_count_time(uint32_t* histogram, uint32_t time);
 };
\ No newline at end of file
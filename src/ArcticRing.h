@@ -0,0 +1,151 @@
+/*
+ * This file is part of ArcticTerminal Library.
+ * Copyright (C) 2023 Alejandro Nicolini
+ *
+ * ArcticTerminal is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ArcticTerminal is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ArcticTerminal. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+// Lock-free multi producer ring of variable length records.
+// Producers reserve space by moving the head with a CAS, write the record and commit it by
+// storing the record position in its header. The reader takes records in order from the tail
+// and stops at the first one not yet committed. Positions only grow, so a header left over
+// from a previous lap never matches the position being read.
+class ArcticRing {
+public:
+	ArcticRing(size_t capacity) {
+		_capacity = 64;
+		while (_capacity < capacity) {
+			_capacity <<= 1;
+		}
+		_buffer = new (std::nothrow) uint8_t[_capacity];
+		if (_buffer == nullptr) {
+			_capacity = 0;
+			return;
+		}
+		// No header may look committed before it is written
+		memset(_buffer, 0xFF, _capacity);
+	}
+
+	~ArcticRing() {
+		delete[] _buffer;
+	}
+
+	// Reserve space for a record, returns where to write it or nullptr if the ring is full
+	uint8_t* reserve(size_t length, uint32_t& position) {
+		uint32_t span = spanOf(length);
+		if (length >= 0xFFFF || span > _capacity) return nullptr;
+
+		uint32_t head = _head.load(std::memory_order_relaxed);
+		while (true) {
+			uint32_t tail = _tail.load(std::memory_order_acquire);
+			uint32_t offset = head & (_capacity - 1);
+			uint32_t pad = (offset + span > _capacity) ? _capacity - offset : 0;
+			if (head + pad + span - tail > _capacity) return nullptr;
+			if (_head.compare_exchange_weak(head, head + pad + span, std::memory_order_acq_rel, std::memory_order_relaxed)) {
+				if (pad) {
+					// Record does not fit before the end, skip to the start of the buffer
+					writeHeader(head, 0xFFFF, pad / 8);
+				}
+				position = head + pad;
+				Header* header = at(position);
+				__atomic_store_n(&header->position, ~position, __ATOMIC_RELAXED);
+				header->length = length;
+				header->span = span / 8;
+				return (uint8_t*)(header + 1);
+			}
+		}
+	}
+
+	// Commit a reserved record with its final length, the reader can take it from now on
+	void commit(uint32_t position, size_t length) {
+		Header* header = at(position);
+		if (length < header->length) {
+			header->length = length;
+		}
+		__atomic_store_n(&header->position, position, __ATOMIC_RELEASE);
+	}
+
+	// Oldest committed record or nullptr, the token is passed back to pop()
+	const uint8_t* peek(size_t& length, uint32_t& token) {
+		while (true) {
+			uint32_t tail = _tail.load(std::memory_order_acquire);
+			if (tail == _head.load(std::memory_order_acquire)) return nullptr;
+			Header* header = at(tail);
+			if (__atomic_load_n(&header->position, __ATOMIC_ACQUIRE) != tail) return nullptr;
+
+			uint32_t span = header->span * 8;
+			if (header->length == 0xFFFF) {
+				_tail.compare_exchange_strong(tail, tail + span, std::memory_order_acq_rel);
+				continue;
+			}
+			if (span < HEADER || (tail & (_capacity - 1)) + span > _capacity) continue;
+			length = header->length;
+			token = tail;
+			return (const uint8_t*)(header + 1);
+		}
+	}
+
+	// Release the record returned by peek(), false if it was taken by someone else meanwhile
+	bool pop(uint32_t token) {
+		// Span is only trusted if the CAS proves the record was still at the tail
+		uint32_t span = at(token)->span * 8;
+		uint32_t tail = token;
+		return _tail.compare_exchange_strong(tail, token + span, std::memory_order_acq_rel);
+	}
+
+	size_t capacity() const {
+		return _capacity;
+	}
+
+	// Bytes in use, including headers and padding
+	size_t used() const {
+		return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire);
+	}
+
+private:
+	struct Header {
+		uint32_t position;
+		uint16_t length;
+		uint16_t span; // record size in 8 byte units, header included
+	};
+	static const uint32_t HEADER = sizeof(Header);
+
+	uint8_t* _buffer;
+	uint32_t _capacity;
+	std::atomic<uint32_t> _head{0};
+	std::atomic<uint32_t> _tail{0};
+
+	static uint32_t spanOf(size_t length) {
+		return HEADER + ((length + 7) & ~7u);
+	}
+
+	Header* at(uint32_t position) {
+		return (Header*)(_buffer + (position & (_capacity - 1)));
+	}
+
+	void writeHeader(uint32_t position, uint16_t length, uint16_t span) {
+		Header* header = at(position);
+		header->length = length;
+		header->span = span;
+		__atomic_store_n(&header->position, position, __ATOMIC_RELEASE);
+	}
+};
\ No newline at end of file
@@ -21,6 +21,9 @@
 
 // Initialize static variables
 int ArcticTerminal::serviceCount = 0;
+const char* ArcticTerminal::_logFormats[ARCTIC_LOG_FORMATS];
+std::atomic<uint32_t> ArcticTerminal::_logIds[ARCTIC_LOG_FORMATS];
+std::atomic<size_t> ArcticTerminal::_logFormatCount{0};
 
 // Constructor for consoles
 ArcticTerminal::ArcticTerminal(const std::string& monitorName) {
@@ -34,10 +37,20 @@ void ArcticTerminal::start(NimBLEServer* existingServer, NimBLEAdvertising* exis
 	if (existingServer != nullptr) {
 		pServer = existingServer;
 	}
+	if (_txMutex == nullptr) {
+		_txMutex = xSemaphoreCreateMutex();
+		_txTimer = xTimerCreate("arctic_tx", pdMS_TO_TICKS(_txLatency ? _txLatency : 1), pdFALSE, this, txTimerCallback);
+		_txsTimer = xTimerCreate("arctic_txs", pdMS_TO_TICKS(_txsInterval ? _txsInterval : 1), pdFALSE, this, txsTimerCallback);
+		_cmdTimer = xTimerCreate("arctic_cmd", 1, pdFALSE, this, cmdTimerCallback);
+	}
+	if (_rxSignal == nullptr) {
+		_rxSignal = xSemaphoreCreateBinary();
+	}
+	_txsSent = millis() - _txsInterval;
 	serviceID = createService(existingAdvertising);
 }
 
-// Create service: Create console with TX, TXS, RX and Name Characteristics
+// Create service: Create console with TX, TXS, RX and Telemetry Characteristics
 int ArcticTerminal::createService(NimBLEAdvertising* existingAdvertising) {
 
 	// Create service
@@ -61,120 +74,1665 @@ int ArcticTerminal::createService(NimBLEAdvertising* existingAdvertising) {
 	NimBLECharacteristic* rxCharacteristic = pService->createCharacteristic(rxCharUUID, NIMBLE_PROPERTY::WRITE | NIMBLE_PROPERTY::WRITE_NR);
 	rxCharacteristic->setCallbacks(new RxCharacteristicCallbacks(this));
 
+	// Telemetry
+	char tmCharUUID[37];
+	snprintf(tmCharUUID, sizeof(tmCharUUID), "4fafc201-1fb5-459e-3%03x-c5c9c3319d%02x", serviceCount, serviceCount);
+	NimBLECharacteristic* tmCharacteristic = pService->createCharacteristic(tmCharUUID, NIMBLE_PROPERTY::NOTIFY);
+
+	// Report rejected notifications back to the console
+	txCharacteristic->setCallbacks(new TxCharacteristicCallbacks(this));
+	txsCharacteristic->setCallbacks(new TxCharacteristicCallbacks(this));
+	tmCharacteristic->setCallbacks(new TxCharacteristicCallbacks(this));
+
 	// Start the service
 	pService->start();
 	existingAdvertising->addServiceUUID(pService->getUUID());
 
 	// Add service to map
-	services[serviceCount] = ServiceCharacteristics{txCharacteristic, txsCharacteristic, rxCharacteristic};
+	services[serviceCount] = ServiceCharacteristics{txCharacteristic, txsCharacteristic, rxCharacteristic, tmCharacteristic};
 	return serviceCount++;
 }
 
-// Printf TX: Multiline TX with format
+// Printf TX: Multiline TX with format, coalesced into full notifications
 void ArcticTerminal::printf(const char* format, ...) {
-	if (!ArcticClient::arctic_connection_status) return;
+	if (_txSubscribers.load() == 0) return;
 	if (serviceID == -1) {
 		return;
 	}
-	char buffer[512];
 	va_list args;
 	va_start(args, format);
-	vsnprintf(buffer, sizeof(buffer), format, args);
+	if (_txRing != nullptr) {
+		txEnqueue(format, args);
+	}
+	else {
+		xSemaphoreTake(_txMutex, portMAX_DELAY);
+		txPrint(format, args);
+		xSemaphoreGive(_txMutex);
+	}
+	va_end(args);
+}
+
+// Flush TX: Send any buffered output now
+void ArcticTerminal::flush() {
+	if (_txMutex == nullptr) return;
+	xSemaphoreTake(_txMutex, portMAX_DELAY);
+	txFlush();
+	xSemaphoreGive(_txMutex);
+}
+
+// Send buffered output and telemetry, caller must hold the TX mutex
+void ArcticTerminal::txFlush() {
+	txCollect();
+	txSend();
+	tmSend();
+
+	// Link still congested, try again after another latency period
+	if (!txEmpty() && _txRing == nullptr) {
+		txArm();
+	}
+}
+
+// Arm the deadline timer for one latency period, the timer callback shortens it to a tick on a mutex collision
+void ArcticTerminal::txArm() {
+	TickType_t period = pdMS_TO_TICKS(_txLatency);
+	xTimerChangePeriod(_txTimer, period ? period : 1, 0);
+}
+
+// Async: Queue printf output for the ArcticClient TX task, 0 returns to direct sends
+void ArcticTerminal::async(size_t capacity) {
+	if (_txMutex != nullptr) {
+		flush();
+	}
+	delete _txRing;
+	_txRing = nullptr;
+	if (capacity > 0) {
+		_txRing = new ArcticRing(capacity);
+	}
+}
+
+// Drain: Move queued output into notifications, returns ms until the next deadline
+uint32_t ArcticTerminal::drain() {
+	if (_txRing == nullptr || _txMutex == nullptr) return portMAX_DELAY;
+	uint32_t wait = portMAX_DELAY;
+	xSemaphoreTake(_txMutex, portMAX_DELAY);
+	txCollect();
+	if (!txEmpty()) {
+		unsigned long elapsed = millis() - _txSince;
+		if (elapsed >= _txLatency) {
+			txSend();
+		}
+		else {
+			wait = _txLatency - elapsed;
+		}
+		if (!txEmpty() && wait == portMAX_DELAY) {
+			wait = 1; // Link congested, retry shortly
+		}
+	}
+	if (_tmCount > 0) {
+		unsigned long elapsed = millis() - _tmSince;
+		if (elapsed >= _txLatency) {
+			tmSend();
+		}
+		else if (_txLatency - elapsed < wait) {
+			wait = _txLatency - elapsed;
+		}
+	}
+	xSemaphoreGive(_txMutex);
+	return wait;
+}
+
+// Latency: Max time (ms) output stays buffered, 0 sends on every printf
+void ArcticTerminal::latency(uint32_t ms) {
+	_txLatency = ms;
+	if (_txTimer != nullptr && ms > 0) {
+		xTimerChangePeriod(_txTimer, pdMS_TO_TICKS(ms), 0);
+	}
+}
+
+// Overflow: What printf does when the link can't keep up.
+// BLOCK waits up to parameter ms for room, SAMPLE keeps 1 in parameter messages while congested.
+void ArcticTerminal::overflow(uint8_t policy, uint32_t parameter) {
+	_txPolicy = policy;
+	_txPolicyParameter = parameter;
+}
+
+// Lost: Messages dropped since start
+uint32_t ArcticTerminal::lost() {
+	return _lostMessages.load();
+}
+
+// Lost bytes: Bytes of the dropped messages
+uint32_t ArcticTerminal::lostBytes() {
+	return _lostBytes.load();
+}
+
+// Queued: Bytes of async output waiting for the TX task
+uint32_t ArcticTerminal::queued() {
+	return _txQueued.load();
+}
+
+// Missed: Notifications some subscribers didn't get while the others did, they are not sent again
+uint32_t ArcticTerminal::missed() {
+	return _txMissed.load();
+}
+
+// Channel: Declare a telemetry channel, integer types send value * scale
+void ArcticTerminal::channel(uint8_t id, const std::string& name, uint8_t type, float scale, bool delta) {
+	if (id >= ARCTIC_TELEMETRY_CHANNELS) return;
+	TmChannel& channel = _tmChannels[id];
+	channel.name = name;
+	channel.type = type;
+	channel.scale = scale;
+	channel.delta = delta && type != ARCTIC_TELEMETRY_FLOAT;
+}
+
+// Sample TX: Queue one value of a telemetry channel, sent in binary with the ones around it
+void ArcticTerminal::sample(uint8_t channel, float value) {
+	samples(channel, &value, 1);
+}
+
+// Samples TX: Queue several values of a telemetry channel
+void ArcticTerminal::samples(uint8_t channel, const float* values, size_t count) {
+	if (_tmSubscribers.load() == 0) return;
+	if (serviceID == -1) {
+		return;
+	}
+	if (channel >= ARCTIC_TELEMETRY_CHANNELS || _tmChannels[channel].type == 0) return;
+	xSemaphoreTake(_txMutex, portMAX_DELAY);
+	for (size_t i = 0; i < count; i++) {
+		tmAppend(channel, values[i]);
+	}
+	tmSchedule(count);
+	xSemaphoreGive(_txMutex);
+}
+
+// Lost samples: Telemetry samples the link rejected
+uint32_t ArcticTerminal::lostSamples() {
+	return _tmLost.load();
+}
 
+// Framed: Split output in sequenced segments the host can reassemble
+void ArcticTerminal::framed(bool enable) {
+	if (_txMutex == nullptr) {
+		_txFramed = enable;
+		if (enable) _txCompressed = false;
+		if (!enable) _txTimestamps = false;
+		return;
+	}
+	xSemaphoreTake(_txMutex, portMAX_DELAY);
+	txSetFramed(enable);
+	xSemaphoreGive(_txMutex);
+}
+
+// Switch framing on or off, caller must hold the TX mutex
+void ArcticTerminal::txSetFramed(bool enable) {
+	txCollect();
+	txSend();
+	txDiscard();
+
+	// Announce the switch on TXS, everything sent on TX after this uses the new format
+	char reply[32];
+	int length = snprintf(reply, sizeof(reply), "ARCTIC_COMMAND_REQ_FRAMED:%d", enable ? 1 : 0);
 	auto servicePair = services.find(serviceID);
 	if (servicePair != services.end()) {
-		if (pServer->getConnectedCount() > 0) {
-			NimBLECharacteristic* txCharacteristic = servicePair->second.txCharacteristic;
-			if (txCharacteristic) {
-				txCharacteristic->setValue((uint8_t*)buffer, strlen(buffer));
-				txCharacteristic->notify(true);
+		txNotify(servicePair->second.txsCharacteristic, (uint8_t*)reply, length);
+	}
+	_txFramed = enable;
+	_txRestart = false;
+	if (!enable) _txTimestamps = false;
+	if (enable && _txCompressed) {
+		_txCompressed = false;
+		delete _txEncoder;
+		_txEncoder = nullptr;
+	}
+	_txSequence = 0;
+	_txsSequence = 0;
+	_txStart = 0;
+	_txLength = 0;
+	_txMarkCount = 0;
+}
+
+// Compressed: Send output as an LZ stream the host decompresses, never framed
+void ArcticTerminal::compressed(bool enable) {
+	if (_txMutex == nullptr) {
+		if (enable && _txEncoder == nullptr) {
+			_txEncoder = new (std::nothrow) ArcticLZEncoder();
+			if (_txEncoder == nullptr) enable = false;
+		}
+		_txCompressed = enable;
+		if (enable) _txFramed = false;
+		if (enable) _txTimestamps = false;
+		return;
+	}
+	xSemaphoreTake(_txMutex, portMAX_DELAY);
+	txSetCompressed(enable);
+	xSemaphoreGive(_txMutex);
+}
+
+// Switch compression on or off, caller must hold the TX mutex
+void ArcticTerminal::txSetCompressed(bool enable) {
+	if (enable && _txEncoder == nullptr) {
+		_txEncoder = new (std::nothrow) ArcticLZEncoder();
+		if (_txEncoder == nullptr) enable = false;
+	}
+	txCollect();
+	txSend();
+	txDiscard();
+
+	// Announce the switch on TXS, the host starts a new stream when it sees it
+	char reply[40];
+	int length = snprintf(reply, sizeof(reply), "ARCTIC_COMMAND_REQ_COMPRESSED:%d", enable ? 1 : 0);
+	auto servicePair = services.find(serviceID);
+	if (servicePair != services.end()) {
+		txNotify(servicePair->second.txsCharacteristic, (uint8_t*)reply, length);
+	}
+	_txCompressed = enable;
+	_txRestart = false;
+	if (enable) {
+		_txFramed = false;
+		_txTimestamps = false;
+		_txEncoder->reset();
+	}
+	else {
+		delete _txEncoder;
+		_txEncoder = nullptr;
+	}
+	_txStart = 0;
+	_txLength = 0;
+	_txMarkCount = 0;
+}
+
+// Timestamps: Start every framed message with its time in us, as a varint delta from the previous one
+void ArcticTerminal::timestamps(bool enable) {
+	if (_txMutex == nullptr) {
+		_txTimestamps = enable;
+		if (enable) {
+			_txFramed = true;
+			_txCompressed = false;
+		}
+		_txStamp = 0;
+		return;
+	}
+	xSemaphoreTake(_txMutex, portMAX_DELAY);
+	txSetTimestamps(enable);
+	xSemaphoreGive(_txMutex);
+}
+
+// Switch timestamps on or off, framing with them, caller must hold the TX mutex
+void ArcticTerminal::txSetTimestamps(bool enable) {
+	if (enable && !_txFramed) {
+		txSetFramed(true);
+	}
+	txCollect();
+	txSend();
+	txDiscard();
+
+	// Announce the switch on TXS, the first delta after it is from time 0
+	char reply[40];
+	int length = snprintf(reply, sizeof(reply), "ARCTIC_COMMAND_REQ_TIMESTAMPS:%d", enable ? 1 : 0);
+	auto servicePair = services.find(serviceID);
+	if (servicePair != services.end()) {
+		txNotify(servicePair->second.txsCharacteristic, (uint8_t*)reply, length);
+	}
+	_txTimestamps = enable;
+	_txStamp = 0;
+	_txStart = 0;
+	_txLength = 0;
+	_txMarkCount = 0;
+}
+
+// Updates TX status, called from the TX characteristic callbacks for each subscriber a notify failed for
+void ArcticTerminal::setTxStatus(int code) {
+	_txFailures++;
+}
+
+// Subscribe: Record a central enabling or disabling notifications, called from the TX characteristic callbacks
+void ArcticTerminal::subscribe(NimBLECharacteristic* characteristic, uint16_t handle, bool enable) {
+	std::atomic<uint32_t>* subscribers = txSubscribers(characteristic);
+	int slot = ArcticClient::connectionSlot(handle);
+	if (subscribers == nullptr || slot < 0) return;
+	if (enable) {
+		subscribers->fetch_or(1u << slot);
+	}
+	else {
+		subscribers->fetch_and(~(1u << slot));
+	}
+}
+
+// Unsubscribe: Forget every subscription of a central, before its connection slot is freed
+void ArcticTerminal::unsubscribe(uint16_t handle) {
+	int slot = ArcticClient::connectionSlot(handle);
+	if (slot < 0) return;
+	_txSubscribers.fetch_and(~(1u << slot));
+	_txsSubscribers.fetch_and(~(1u << slot));
+	_tmSubscribers.fetch_and(~(1u << slot));
+}
+
+// Subscribed: True while some central receives the printf output
+bool ArcticTerminal::subscribed() {
+	return _txSubscribers.load() != 0;
+}
+
+// Subscriber mask of one of the console characteristics, nullptr for any other
+std::atomic<uint32_t>* ArcticTerminal::txSubscribers(NimBLECharacteristic* characteristic) {
+	auto servicePair = services.find(serviceID);
+	if (servicePair == services.end()) return nullptr;
+	if (characteristic == servicePair->second.txCharacteristic) return &_txSubscribers;
+	if (characteristic == servicePair->second.txsCharacteristic) return &_txsSubscribers;
+	if (characteristic == servicePair->second.tmCharacteristic) return &_tmSubscribers;
+	return nullptr;
+}
+
+// Print into the TX buffer applying the overflow policy, caller must hold the TX mutex
+void ArcticTerminal::txPrint(const char* format, va_list args) {
+	uint32_t stamp = micros();
+	if (_txCongested) {
+		txPush();
+	}
+	if (_txCongested && _txPolicy == ARCTIC_OVERFLOW_SAMPLE && _txPolicyParameter > 1) {
+		if (++_txSampled % _txPolicyParameter != 0) {
+			txLose(format, args);
+			return;
+		}
+	}
+	txReport();
+	if (txFormat(format, args, stamp)) return;
+
+	// No room left, the link is not taking notifications
+	if (_txPolicy == ARCTIC_OVERFLOW_BLOCK) {
+		TickType_t since = xTaskGetTickCount();
+		while (xTaskGetTickCount() - since < pdMS_TO_TICKS(_txPolicyParameter)) {
+			xSemaphoreGive(_txMutex);
+			vTaskDelay(1);
+			xSemaphoreTake(_txMutex, portMAX_DELAY);
+			if (txFormat(format, args, stamp)) return;
+		}
+	}
+	else if (_txPolicy == ARCTIC_OVERFLOW_DROP_OLDEST) {
+		txDiscard();
+		if (txFormat(format, args, stamp)) return;
+	}
+	txLose(format, args);
+}
+
+// Format straight into the TX buffer, false if there is no room for the message
+bool ArcticTerminal::txFormat(const char* format, va_list args, uint32_t stamp) {
+	if (_txCompressed) {
+		return txFormatCompressed(format, args);
+	}
+	if (txEmpty()) {
+		txOpen();
+	}
+	else if (_txStart > 0 && ARCTIC_TX_BUFFER_SIZE - _txLength < _txPayload) {
+		txCompact();
+	}
+
+	uint8_t time[ARCTIC_STAMP_MAX];
+	size_t timeLength = txStamp(stamp, time);
+	size_t header = _txFramed ? ARCTIC_SEGMENT_HEADER + timeLength : 0;
+	size_t offset = _txLength + header;
+	size_t space = offset < ARCTIC_TX_BUFFER_SIZE ? ARCTIC_TX_BUFFER_SIZE - offset : 0;
+
+	va_list attempt;
+	va_copy(attempt, args);
+	int length = vsnprintf(space ? (char*)_txBuffer + offset : nullptr, space, format, attempt);
+	va_end(attempt);
+	if (length <= 0) return true;
+	if (_txFramed && (size_t)length > ARCTIC_SEGMENT_MAX - timeLength) {
+		length = ARCTIC_SEGMENT_MAX - timeLength;
+	}
+
+	if ((size_t)length < space) {
+		// Fits in the TX buffer, send every full payload and keep the rest
+		if (_txFramed) {
+			txSegment(_txBuffer + _txLength, timeLength + length, false);
+			memcpy(_txBuffer + _txLength + ARCTIC_SEGMENT_HEADER, time, timeLength);
+		}
+		txMark(_txLength, 1, stamp);
+		_txLength = offset + length;
+		_txStamp = stamp;
+		txPush();
+	}
+	else if (!txEmpty()) {
+		// Send what is waiting and try again on an empty buffer
+		txSend();
+		if (!txEmpty()) return false;
+		return txFormat(format, args, stamp);
+	}
+	else if (!txLong(format, args, length, stamp)) {
+		return false;
+	}
+	txSchedule();
+	return true;
+}
+
+// Format the whole message first, then compress it into the TX buffer
+bool ArcticTerminal::txFormatCompressed(const char* format, va_list args) {
+	char buffer[ARCTIC_TX_BUFFER_SIZE];
+	va_list attempt;
+	va_copy(attempt, args);
+	int length = vsnprintf(buffer, sizeof(buffer), format, attempt);
+	va_end(attempt);
+	if (length <= 0) return true;
+
+	uint8_t* data = (uint8_t*)buffer;
+	uint8_t* block = nullptr;
+	if ((size_t)length >= sizeof(buffer)) {
+		block = new (std::nothrow) uint8_t[length + 1];
+		if (block == nullptr) return false;
+		va_list copy;
+		va_copy(copy, args);
+		vsnprintf((char*)block, length + 1, format, copy);
+		va_end(copy);
+		data = block;
+	}
+	bool sent = txCompress(data, length);
+	delete[] block;
+	if (sent) {
+		txSchedule();
+	}
+	return sent;
+}
+
+// Compress into the TX buffer, false if the link is congested before any of it was taken. A message
+// only starts once it fits whole, or the buffer is empty for one longer than the buffer. Such a long
+// one waits for room while the overflow policy allows it, then is dropped with the rest of the stream.
+bool ArcticTerminal::txCompress(const uint8_t* data, size_t length) {
+	bool started = false;
+	size_t total = length;
+	TickType_t since = xTaskGetTickCount();
+	while (length > 0) {
+		if (txEmpty()) {
+			txOpen();
+			_txSince = millis();
+		}
+		else {
+			txCompact();
+		}
+
+		size_t room = ARCTIC_TX_BUFFER_SIZE - _txLength;
+		size_t needed = ARCTIC_LZ_OVERHEAD + std::min<size_t>(length, ARCTIC_LZ_MIN_ROOM);
+		if (!started) {
+			needed = std::min(ArcticLZEncoder::bound(length), (size_t)ARCTIC_TX_BUFFER_SIZE);
+		}
+		if (room < needed) {
+			txSend();
+			if (txEmpty()) continue;
+			if (!started) return false;
+			if (_txPolicy != ARCTIC_OVERFLOW_BLOCK || xTaskGetTickCount() - since >= pdMS_TO_TICKS(_txPolicyParameter)) {
+				// Give up on the rest, the host can't decode past the missing bytes. The buffer only holds
+				// this message, it is dropped and a new stream starts, announced before any more output.
+				txLost(1, total);
+				_txEncoder->reset();
+				_txStart = 0;
+				_txLength = 0;
+				_txRestart = true;
+				return true;
 			}
+			vTaskDelay(1);
+			continue;
 		}
+		size_t chunk = std::min<size_t>(std::min<size_t>(length, room - ARCTIC_LZ_OVERHEAD), ARCTIC_LZ_CHUNK);
+		_txLength += _txEncoder->compress(data, chunk, _txBuffer + _txLength);
+		data += chunk;
+		length -= chunk;
+		started = true;
+		txPush();
+	}
+	return true;
+}
+
+// Partial payload: send now or let the deadline timer pick it up
+void ArcticTerminal::txSchedule() {
+	if (txEmpty()) return;
+	if (_txLatency == 0) {
+		txSend();
+	}
+	if (!txEmpty() && xTimerIsTimerActive(_txTimer) == pdFALSE) {
+		txArm();
+	}
+}
+
+// Messages longer than the TX buffer are formatted once more into a block sent fragment by fragment
+bool ArcticTerminal::txLong(const char* format, va_list args, size_t length, uint32_t stamp) {
+	auto servicePair = services.find(serviceID);
+	if (servicePair == services.end()) return true;
+	uint8_t time[ARCTIC_STAMP_MAX];
+	size_t timeLength = txStamp(stamp, time);
+	size_t frame = _txFramed ? ARCTIC_FRAME_HEADER + ARCTIC_SEGMENT_HEADER + timeLength : 0;
+	uint8_t* block = new (std::nothrow) uint8_t[frame + length + 1];
+	if (block == nullptr) return false;
+	va_list copy;
+	va_copy(copy, args);
+	vsnprintf((char*)block + frame, length + 1, format, copy);
+	va_end(copy);
+	if (_txFramed) {
+		txSegment(block + ARCTIC_FRAME_HEADER, timeLength + length, false);
+		memcpy(block + ARCTIC_FRAME_HEADER + ARCTIC_SEGMENT_HEADER, time, timeLength);
+	}
+
+	size_t start = 0;
+	TickType_t since = xTaskGetTickCount();
+	while (true) {
+		start = txFrames(servicePair->second.txCharacteristic, block, start, frame + length, _txSequence, _txPayload, true);
+		if (start >= frame + length) {
+			_txStamp = stamp;
+			break;
+		}
+		if (start == 0 && _txPolicy != ARCTIC_OVERFLOW_BLOCK) {
+			delete[] block;
+			return false;
+		}
+		if (_txPolicy != ARCTIC_OVERFLOW_BLOCK || xTaskGetTickCount() - since >= pdMS_TO_TICKS(_txPolicyParameter)) {
+			// Give up on the rest, a skipped sequence number tells the host to drop the partial message
+			txLost(1, length);
+			_txSequence++;
+			break;
+		}
+		// Keep the TX mutex, nothing else may be sent between fragments of this message. The BLE host
+		// task never takes it, so it keeps freeing notification buffers meanwhile.
+		vTaskDelay(1);
+	}
+	delete[] block;
+	return true;
+}
+
+// Format into the async queue, producers only pay for the formatting and one copy
+void ArcticTerminal::txEnqueue(const char* format, va_list args) {
+	char buffer[ARCTIC_TX_BUFFER_SIZE];
+	va_list attempt;
+	va_copy(attempt, args);
+	int length = vsnprintf(buffer, sizeof(buffer), format, attempt);
+	va_end(attempt);
+	if (length <= 0) return;
+
+	// The TX task appends each queued message whole to one TX buffer, together with its segment header,
+	// timestamp or compression overhead. Half the buffer (256 bytes by default) always leaves room for
+	// those, longer messages are sent in order from this task instead. The ring size plays no part.
+	if ((size_t)length >= ARCTIC_TX_BUFFER_SIZE / 2) {
+		xSemaphoreTake(_txMutex, portMAX_DELAY);
+		txCollect();
+
+		// Everything queued before goes first
+		TickType_t since = xTaskGetTickCount();
+		while (_txRing->used() > 0) {
+			if (_txPolicy == ARCTIC_OVERFLOW_BLOCK && xTaskGetTickCount() - since < pdMS_TO_TICKS(_txPolicyParameter)) {
+				xSemaphoreGive(_txMutex);
+				vTaskDelay(1);
+				xSemaphoreTake(_txMutex, portMAX_DELAY);
+				txCollect();
+				continue;
+			}
+			if (_txPolicy == ARCTIC_OVERFLOW_DROP_OLDEST) {
+				while (txDropOldest()) {
+				}
+			}
+			break;
+		}
+		if (_txRing->used() > 0) {
+			txLost(1, length);
+		}
+		else {
+			txPrint(format, args);
+		}
+		xSemaphoreGive(_txMutex);
+		return;
+	}
+
+	// Queue more than half full counts as congested for sampling
+	if (_txPolicy == ARCTIC_OVERFLOW_SAMPLE && _txPolicyParameter > 1 && _txRing->used() > _txRing->capacity() / 2) {
+		if (++_txSampled % _txPolicyParameter != 0) {
+			txLost(1, length);
+			return;
+		}
+	}
+	// Records start with the time the message was queued
+	uint32_t stamp = micros();
+	size_t size = sizeof(stamp) + length;
+	uint32_t position;
+	uint8_t* record = _txRing->reserve(size, position);
+	if (record == nullptr) {
+		if (_txPolicy == ARCTIC_OVERFLOW_BLOCK) {
+			TickType_t since = xTaskGetTickCount();
+			while (record == nullptr && xTaskGetTickCount() - since < pdMS_TO_TICKS(_txPolicyParameter)) {
+				if (ArcticClient::arctic_tx_task != nullptr) {
+					xTaskNotifyGive(ArcticClient::arctic_tx_task);
+				}
+				vTaskDelay(1);
+				record = _txRing->reserve(size, position);
+			}
+		}
+		else if (_txPolicy == ARCTIC_OVERFLOW_DROP_OLDEST) {
+			// Take the reader side for a moment and discard the oldest records
+			xSemaphoreTake(_txMutex, portMAX_DELAY);
+			while (record == nullptr && txDropOldest()) {
+				record = _txRing->reserve(size, position);
+			}
+			xSemaphoreGive(_txMutex);
+		}
+		if (record == nullptr) {
+			txLost(1, length);
+			return;
+		}
+	}
+	memcpy(record, &stamp, sizeof(stamp));
+	memcpy(record + sizeof(stamp), buffer, length);
+	_txRing->commit(position, size);
+	txQueued(size);
+}
+
+// Drop the oldest queued record, false if there is none, caller must hold the TX mutex
+bool ArcticTerminal::txDropOldest() {
+	size_t length;
+	uint32_t token;
+	if (_txRing->peek(length, token) == nullptr) return false;
+	if (_txRing->pop(token)) {
+		_txQueued -= length;
+		txLost(1, length - sizeof(uint32_t));
+	}
+	return true;
+}
+
+// Count queued bytes, waking the TX task when the queue stops being empty or a full payload is waiting
+void ArcticTerminal::txQueued(size_t length) {
+	size_t queued = _txQueued.fetch_add(length) + length;
+	if (ArcticClient::arctic_tx_task != nullptr) {
+		if (queued == length || (queued >= _txPayload && queued - length < _txPayload)) {
+			xTaskNotifyGive(ArcticClient::arctic_tx_task);
+		}
+	}
+}
+
+// Move queued records into the TX buffer until it is full, caller must hold the TX mutex
+void ArcticTerminal::txCollect() {
+	if (_txRing == nullptr) return;
+	size_t length;
+	uint32_t token;
+	const uint8_t* record;
+	while ((record = _txRing->peek(length, token)) != nullptr) {
+		uint32_t stamp;
+		memcpy(&stamp, record, sizeof(stamp));
+		if (!txAppend(record + sizeof(stamp), length - sizeof(stamp), stamp)) return;
+		_txRing->pop(token);
+		_txQueued -= length;
+	}
+
+	// Queue drained, report what was dropped while it was full
+	txReport();
+}
+
+// Append one message to the TX buffer, false if the link is congested and there is no room
+bool ArcticTerminal::txAppend(const uint8_t* data, size_t length, uint32_t stamp, bool marker) {
+	if (_txCompressed) {
+		return txCompress(data, length);
+	}
+	uint8_t time[ARCTIC_STAMP_MAX];
+	size_t timeLength = txStamp(stamp, time);
+	size_t header = _txFramed ? ARCTIC_SEGMENT_HEADER + timeLength : 0;
+	if (txEmpty()) {
+		txOpen();
+		_txSince = millis();
+	}
+	if (_txLength + header + length > ARCTIC_TX_BUFFER_SIZE) {
+		txCompact();
+	}
+	if (_txLength + header + length > ARCTIC_TX_BUFFER_SIZE) {
+		txSend();
+		if (!txEmpty()) return false;
+		txOpen();
+		_txSince = millis();
+	}
+	if (_txFramed) {
+		txSegment(_txBuffer + _txLength, timeLength + length, false);
+		memcpy(_txBuffer + _txLength + ARCTIC_SEGMENT_HEADER, time, timeLength);
+	}
+	txMark(_txLength, marker ? 0 : 1, stamp);
+	memcpy(_txBuffer + _txLength + header, data, length);
+	_txLength += header + length;
+	_txStamp = stamp;
+	txPush();
+	return true;
+}
+
+// Emit the in-band lost messages marker ahead of the next message, caller must hold the TX mutex
+void ArcticTerminal::txReport() {
+	uint32_t reported = _lostReported.load();
+	uint32_t messages = _lostMessages.load();
+	if (messages == reported) return;
+
+	// Marker keeps its own mark so dropping the oldest output never drops it
+	if (_txMarkCount >= ARCTIC_TX_MARKS - 1) return;
+	uint32_t bytes = _lostBytes.load();
+	uint32_t reportedBytes = _lostReportedBytes.load();
+
+	char marker[64];
+	int length = snprintf(marker, sizeof(marker), "*** %lu messages lost (%lu bytes) ***\n", (unsigned long)(messages - reported), (unsigned long)(bytes - reportedBytes));
+	if (txAppend((const uint8_t*)marker, length, micros(), true)) {
+		_lostReported = messages;
+		_lostReportedBytes = bytes;
+	}
+}
+
+// Count a dropped message
+void ArcticTerminal::txLost(uint32_t messages, size_t bytes) {
+	_lostMessages += messages;
+	_lostBytes += bytes;
+}
+
+// Count a dropped message that was never formatted
+void ArcticTerminal::txLose(const char* format, va_list args) {
+	va_list attempt;
+	va_copy(attempt, args);
+	int length = vsnprintf(nullptr, 0, format, attempt);
+	va_end(attempt);
+	txLost(1, length > 0 ? length : 0);
+}
+
+// Drop staged messages nothing has been sent of yet, caller must hold the TX mutex
+void ArcticTerminal::txDiscard() {
+	if (_txMarkCount == 0) return;
+	size_t to = _txMarks[0].offset;
+	size_t kept = 0;
+
+	// Time deltas restart from the last message the host still gets
+	int32_t delta = 0;
+	if (_txTimestamps) {
+		txStampRead(_txBuffer + to + ARCTIC_SEGMENT_HEADER, delta);
+	}
+	uint32_t base = _txMarks[0].stamp - delta;
+
+	for (size_t i = 0; i < _txMarkCount; i++) {
+		size_t from = _txMarks[i].offset;
+		size_t end = i + 1 < _txMarkCount ? _txMarks[i + 1].offset : _txLength;
+		if (_txMarks[i].count == 0) {
+			// Lost messages marker, keep it and encode its time again from the new base
+			size_t size = end - from;
+			if (_txTimestamps) {
+				size_t header = ARCTIC_SEGMENT_HEADER + txStampRead(_txBuffer + from + ARCTIC_SEGMENT_HEADER, delta);
+				size_t text = end - from - header;
+				uint8_t time[ARCTIC_STAMP_MAX];
+				_txStamp = base;
+				size_t timeLength = txStamp(_txMarks[i].stamp, time);
+				memmove(_txBuffer + to + ARCTIC_SEGMENT_HEADER + timeLength, _txBuffer + from + header, text);
+				txSegment(_txBuffer + to, timeLength + text, false);
+				memcpy(_txBuffer + to + ARCTIC_SEGMENT_HEADER, time, timeLength);
+				size = ARCTIC_SEGMENT_HEADER + timeLength + text;
+			}
+			else {
+				memmove(_txBuffer + to, _txBuffer + from, size);
+			}
+			_txMarks[kept++] = TxMark{(uint16_t)to, 0, _txMarks[i].stamp};
+			base = _txMarks[i].stamp;
+			to += size;
+			continue;
+		}
+		if (!_txFramed) {
+			txLost(_txMarks[i].count, end - from);
+			continue;
+		}
+
+		// Staged segments are never cut, each one is a whole message
+		for (size_t pos = from; pos < end;) {
+			size_t size = (_txBuffer[pos] | (_txBuffer[pos + 1] << 8)) & ~ARCTIC_SEGMENT_MORE;
+			size_t header = _txTimestamps ? txStampRead(_txBuffer + pos + ARCTIC_SEGMENT_HEADER, delta) : 0;
+			txLost(1, size - header);
+			pos += ARCTIC_SEGMENT_HEADER + size;
+		}
+	}
+	_txLength = to;
+	_txMarkCount = kept;
+	_txStamp = base;
+	if (txEmpty()) {
+		_txStart = 0;
+		_txLength = 0;
+		_txMarkCount = 0;
+	}
+}
+
+// Remember where a message starts in the TX buffer, count 0 marks a lost messages marker
+void ArcticTerminal::txMark(size_t offset, uint16_t count, uint32_t stamp) {
+	if (_txMarkCount < ARCTIC_TX_MARKS) {
+		_txMarks[_txMarkCount++] = TxMark{(uint16_t)offset, count, stamp};
+	}
+	else {
+		_txMarks[ARCTIC_TX_MARKS - 1].count++;
 	}
-	va_end(args);
 }
 
-// Singlef TX: Single line TX with format
+// Encode a message time as a zigzag varint delta from the previous message, nothing if timestamps are off
+size_t ArcticTerminal::txStamp(uint32_t stamp, uint8_t* out) {
+	if (!_txTimestamps) return 0;
+	int32_t delta = (int32_t)(stamp - _txStamp);
+	uint32_t zigzag = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+	size_t length = 0;
+	do {
+		out[length] = zigzag & 0x7F;
+		zigzag >>= 7;
+		if (zigzag) out[length] |= 0x80;
+		length++;
+	} while (zigzag);
+	return length;
+}
+
+// Decode a message time delta, returns its size
+size_t ArcticTerminal::txStampRead(const uint8_t* data, int32_t& delta) {
+	uint32_t zigzag = 0;
+	size_t length = 0;
+	do {
+		zigzag |= (uint32_t)(data[length] & 0x7F) << (7 * length);
+	} while ((data[length++] & 0x80) && length < ARCTIC_STAMP_MAX);
+	delta = (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+	return length;
+}
+
+// Send every full payload in the TX buffer
+void ArcticTerminal::txPush() {
+	if (_txRestart && !txRestart()) return;
+	auto servicePair = services.find(serviceID);
+	if (servicePair != services.end()) {
+		txSent(txFrames(servicePair->second.txCharacteristic, _txBuffer, _txStart, _txLength, _txSequence, _txPayload, false));
+	}
+}
+
+// Send everything in the TX buffer, caller must hold the TX mutex
+void ArcticTerminal::txSend() {
+	if (txEmpty()) {
+		_txStart = 0;
+		_txLength = 0;
+		_txMarkCount = 0;
+		return;
+	}
+	if (_txRestart && !txRestart()) return;
+	auto servicePair = services.find(serviceID);
+	if (servicePair != services.end()) {
+		txSent(txFrames(servicePair->second.txCharacteristic, _txBuffer, _txStart, _txLength, _txSequence, _txPayload, true));
+	}
+}
+
+// Announce a new compressed stream on TXS, the host resets its decoder before the output that follows
+bool ArcticTerminal::txRestart() {
+	auto servicePair = services.find(serviceID);
+	if (servicePair == services.end()) return true;
+	const char reply[] = "ARCTIC_COMMAND_REQ_COMPRESSED:1";
+	if (!txNotify(servicePair->second.txsCharacteristic, (const uint8_t*)reply, sizeof(reply) - 1)) return false;
+	_txRestart = false;
+	return true;
+}
+
+// Move the TX buffer start past sent data and forget marks of messages already on their way
+void ArcticTerminal::txSent(size_t start) {
+	if (start >= _txLength) {
+		_txStart = 0;
+		_txLength = 0;
+		_txMarkCount = 0;
+		return;
+	}
+	_txStart = start;
+	size_t first = start + (_txFramed ? ARCTIC_FRAME_HEADER : 0);
+	size_t sent = 0;
+	while (sent < _txMarkCount && _txMarks[sent].offset < first) {
+		sent++;
+	}
+	if (sent > 0) {
+		memmove(_txMarks, _txMarks + sent, (_txMarkCount - sent) * sizeof(TxMark));
+		_txMarkCount -= sent;
+	}
+}
+
+// Move the unsent tail to the front of the TX buffer
+void ArcticTerminal::txCompact() {
+	if (_txStart == 0) return;
+	memmove(_txBuffer, _txBuffer + _txStart, _txLength - _txStart);
+	for (size_t i = 0; i < _txMarkCount; i++) {
+		_txMarks[i].offset -= _txStart;
+	}
+	_txLength -= _txStart;
+	_txStart = 0;
+}
+
+// Start a new notification at the front of the TX buffer
+void ArcticTerminal::txOpen() {
+	_txStart = 0;
+	_txLength = _txFramed ? ARCTIC_FRAME_HEADER : 0;
+	_txMarkCount = 0;
+	_txPayload = txPayload(_txSubscribers.load());
+}
+
+// Check if the TX buffer holds no data besides the frame header
+bool ArcticTerminal::txEmpty() {
+	return _txLength <= _txStart + (_txFramed ? ARCTIC_FRAME_HEADER : 0);
+}
+
+// Write a segment header: 15 bit length, top bit set if the message continues
+void ArcticTerminal::txSegment(uint8_t* header, size_t length, bool more) {
+	uint16_t value = (uint16_t)length | (more ? ARCTIC_SEGMENT_MORE : 0);
+	header[0] = value & 0xFF;
+	header[1] = value >> 8;
+}
+
+// Send buffer[start, length) as payload-sized notifications and return where unsent data begins.
+// In framed mode the next frame header is written over bytes of the previous notification, which
+// were already sent, so long messages are fragmented without being copied. A rejected notification
+// is left untouched so it can be sent again.
+size_t ArcticTerminal::txFrames(NimBLECharacteristic* characteristic, uint8_t* buffer, size_t start, size_t length, uint8_t& sequence, size_t payload, bool final) {
+	while (start < length) {
+		size_t end = start + payload;
+		if (end > length) {
+			if (!final) break;
+			end = length;
+		}
+
+		size_t cut = end;
+		size_t split = 0;
+		uint16_t original = 0;
+		if (_txFramed) {
+			// Find the segment crossing the payload boundary and cut it in two
+			size_t pos = start + ARCTIC_FRAME_HEADER;
+			while (pos < end) {
+				if (pos + ARCTIC_SEGMENT_HEADER >= end) {
+					cut = pos;
+					break;
+				}
+				uint16_t header = buffer[pos] | (buffer[pos + 1] << 8);
+				size_t size = header & ~ARCTIC_SEGMENT_MORE;
+				if (pos + ARCTIC_SEGMENT_HEADER + size <= end) {
+					pos += ARCTIC_SEGMENT_HEADER + size;
+					continue;
+				}
+				txSegment(buffer + pos, end - pos - ARCTIC_SEGMENT_HEADER, true);
+				original = header;
+				split = pos;
+				break;
+			}
+			buffer[start] = sequence;
+		}
+
+		if (!txNotify(characteristic, buffer + start, cut - start)) {
+			if (split) {
+				buffer[split] = original & 0xFF;
+				buffer[split + 1] = original >> 8;
+			}
+			return start;
+		}
+		if (_txFramed) {
+			sequence++;
+		}
+		if (cut >= length) return length;
+
+		start = cut;
+		if (_txFramed) {
+			start -= ARCTIC_FRAME_HEADER;
+			if (split) {
+				size_t remaining = (original & ~ARCTIC_SEGMENT_MORE) - (cut - split - ARCTIC_SEGMENT_HEADER);
+				start -= ARCTIC_SEGMENT_HEADER;
+				txSegment(buffer + start + ARCTIC_FRAME_HEADER, remaining, original & ARCTIC_SEGMENT_MORE);
+			}
+		}
+	}
+	return start;
+}
+
+// Send one notification, false if the stack rejected it
+bool ArcticTerminal::txNotify(NimBLECharacteristic* characteristic, const uint8_t* data, size_t length) {
+	if (characteristic == nullptr) return true;
+	std::atomic<uint32_t>* subscribers = txSubscribers(characteristic);
+	if (subscribers == nullptr || subscribers->load() == 0) return true;
+	_txFailures = 0;
+	characteristic->setValue(data, length);
+	characteristic->notify(true);
+
+	// Each subscriber gets its own copy. Once any of them took it a retry would repeat it for those,
+	// so the centrals the stack refused miss this one and the stream goes on.
+	int peers = __builtin_popcount(subscribers->load());
+	_txCongested = (_txFailures > 0 && _txFailures >= peers);
+	if (!_txCongested) {
+		if (_txFailures > 0) {
+			_txMissed += _txFailures;
+		}
+		ArcticClient::arctic_tx_bytes += length;
+	}
+	return !_txCongested;
+}
+
+// Register format: Record a format string for the host, once per ARCTIC_LOG call site
+uint32_t ArcticTerminal::registerFormat(uint32_t id, const char* format) {
+	size_t count = _logFormatCount.load();
+	for (size_t i = 0; i < count && i < ARCTIC_LOG_FORMATS; i++) {
+		if (_logIds[i].load() == id) return id;
+	}
+	size_t slot = _logFormatCount.fetch_add(1);
+	if (slot < ARCTIC_LOG_FORMATS) {
+		// Id is written last, readers skip a slot until it is set
+		_logFormats[slot] = format;
+		_logIds[slot].store(id);
+	}
+	return id;
+}
+
+// Append a log record to the telemetry buffer, it goes out with the samples around it
+void ArcticTerminal::logRecord(uint32_t id, const uint8_t* arguments, size_t length) {
+	if (_tmSubscribers.load() == 0) return;
+	if (serviceID == -1) {
+		return;
+	}
+	size_t size = 1 + sizeof(id) + length;
+	xSemaphoreTake(_txMutex, portMAX_DELAY);
+
+	// The MTU may have dropped since the arguments were sized, don't flush the pending samples for nothing
+	if (ARCTIC_FRAME_HEADER + size > txPayload(_tmSubscribers.load())) {
+		_tmLost++;
+		xSemaphoreGive(_txMutex);
+		return;
+	}
+	if (_tmLength == 0 || _tmLength + size > _tmPayload) {
+		tmSend();
+		_tmLength = ARCTIC_FRAME_HEADER;
+		_tmPayload = txPayload(_tmSubscribers.load());
+		_tmSince = millis();
+	}
+	if (_tmLength + size <= _tmPayload) {
+		_tmBuffer[_tmLength++] = ARCTIC_LOG_TAG;
+		for (size_t i = 0; i < sizeof(id); i++) {
+			_tmBuffer[_tmLength++] = id >> (8 * i);
+		}
+		memcpy(_tmBuffer + _tmLength, arguments, length);
+		_tmLength += length;
+		_tmBlock = 0;
+		_tmCount++;
+		tmSchedule(1);
+	}
+	else {
+		_tmLost++;
+	}
+	xSemaphoreGive(_txMutex);
+}
+
+// Log room: Argument bytes a record can carry, it must fit one notification to the telemetry subscribers
+size_t ArcticTerminal::logRoom() {
+	size_t payload = txPayload(_tmSubscribers.load());
+	size_t header = ARCTIC_FRAME_HEADER + 1 + sizeof(uint32_t);
+	return payload > header ? std::min(payload - header, (size_t)ARCTIC_LOG_RECORD) : 0;
+}
+
+// Zigzag varint, the host reads it back as a 64 bit value and casts it to the format type
+void ArcticTerminal::logInteger(uint8_t* record, size_t& length, size_t limit, int64_t value) {
+	uint64_t zigzag = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+	uint8_t encoded[10];
+	size_t size = 0;
+	do {
+		encoded[size] = zigzag & 0x7F;
+		zigzag >>= 7;
+		if (zigzag) encoded[size] |= 0x80;
+		size++;
+	} while (zigzag);
+	if (length + size > limit) {
+		length = limit + 1;
+		return;
+	}
+	memcpy(record + length, encoded, size);
+	length += size;
+}
+
+// Little endian float
+void ArcticTerminal::logFloat(uint8_t* record, size_t& length, size_t limit, float value) {
+	if (length + sizeof(value) > limit) {
+		length = limit + 1;
+		return;
+	}
+	memcpy(record + length, &value, sizeof(value));
+	length += sizeof(value);
+}
+
+// Length byte and the string, cut to what is left of the record
+void ArcticTerminal::logString(uint8_t* record, size_t& length, size_t limit, const char* value) {
+	if (length >= limit) {
+		length = limit + 1;
+		return;
+	}
+	size_t size = value ? strlen(value) : 0;
+	size_t room = limit - length - 1;
+	if (size > room) size = room;
+	if (size > 0x7F) size = 0x7F;
+	record[length++] = size;
+	memcpy(record + length, value, size);
+	length += size;
+}
+
+// Send the registered format strings on TXS, all of them or the one matching filter (hex id)
+void ArcticTerminal::logFormats(const std::string& filter) {
+	uint32_t wanted = filter.empty() ? 0 : strtoul(filter.c_str(), nullptr, 16);
+	size_t count = std::min<size_t>(_logFormatCount.load(), ARCTIC_LOG_FORMATS);
+	if (filter.empty()) {
+		txsReply("ARCTIC_COMMAND_REQ_FORMATS:%u", (unsigned)count);
+	}
+	for (size_t i = 0; i < count; i++) {
+		uint32_t id = _logIds[i].load();
+		if (id == 0 || (!filter.empty() && id != wanted)) continue;
+		txsReply("ARCTIC_COMMAND_REQ_FORMAT:%08lx,%s", (unsigned long)id, _logFormats[i]);
+	}
+}
+
+// Encode one sample, extending the open block when it is for the same channel
+void ArcticTerminal::tmAppend(uint8_t id, float value) {
+	const TmChannel& channel = _tmChannels[id];
+	size_t size = channel.type == ARCTIC_TELEMETRY_INT16 ? 2 : 4;
+	uint32_t bits;
+	int32_t quantized = 0;
+	if (channel.type == ARCTIC_TELEMETRY_FLOAT) {
+		memcpy(&bits, &value, sizeof(bits));
+	}
+	else {
+		float scaled = value * channel.scale;
+		float limit = channel.type == ARCTIC_TELEMETRY_INT16 ? 32767.0f : 2147483520.0f;
+		scaled = scaled > limit ? limit : (scaled < -limit ? -limit : scaled);
+		quantized = (int32_t)lroundf(scaled);
+		bits = (uint32_t)quantized;
+	}
+
+	// Delta values are zigzag varints, small differences take a single byte
+	uint8_t encoded[5];
+	size_t length = 0;
+	bool extend = _tmBlock != 0 && _tmBuffer[_tmBlock] == id && _tmBuffer[_tmBlock + 1] < 0xFF;
+	if (!extend || !channel.delta) {
+		for (size_t i = 0; i < size; i++) {
+			encoded[i] = bits >> (8 * i);
+		}
+		length = size;
+	}
+	else {
+		int32_t difference = (int32_t)((uint32_t)quantized - (uint32_t)_tmLast);
+		uint32_t zigzag = ((uint32_t)difference << 1) ^ (uint32_t)(difference >> 31);
+		do {
+			encoded[length] = zigzag & 0x7F;
+			zigzag >>= 7;
+			if (zigzag) encoded[length] |= 0x80;
+			length++;
+		} while (zigzag);
+	}
+	if (_tmLength == 0 || _tmLength + (extend ? length : ARCTIC_TELEMETRY_BLOCK + size) > _tmPayload) {
+		tmSend();
+		_tmLength = ARCTIC_FRAME_HEADER;
+		_tmPayload = txPayload(_tmSubscribers.load());
+		_tmSince = millis();
+		extend = false;
+	}
+	if (!extend) {
+		// New block, its first value is never a delta
+		_tmBlock = _tmLength;
+		_tmBuffer[_tmLength++] = id;
+		_tmBuffer[_tmLength++] = 0;
+		for (size_t i = 0; i < size; i++) {
+			encoded[i] = bits >> (8 * i);
+		}
+		length = size;
+	}
+	memcpy(_tmBuffer + _tmLength, encoded, length);
+	_tmLength += length;
+	_tmBuffer[_tmBlock + 1]++;
+	_tmLast = quantized;
+	_tmCount++;
+}
+
+// Partial telemetry payload: send now, wake the TX task or let the deadline timer pick it up
+void ArcticTerminal::tmSchedule(size_t added) {
+	if (_tmCount == 0) return;
+	if (_txLatency == 0) {
+		tmSend();
+	}
+	else if (_txRing != nullptr) {
+		if (_tmCount == added && ArcticClient::arctic_tx_task != nullptr) {
+			xTaskNotifyGive(ArcticClient::arctic_tx_task);
+		}
+	}
+	else if (xTimerIsTimerActive(_txTimer) == pdFALSE) {
+		txArm();
+	}
+}
+
+// Send the telemetry buffer, samples the link rejects are counted and skipped
+void ArcticTerminal::tmSend() {
+	if (_tmCount > 0) {
+		auto servicePair = services.find(serviceID);
+		if (servicePair != services.end()) {
+			_tmBuffer[0] = _tmSequence++;
+			if (!txNotify(servicePair->second.tmCharacteristic, _tmBuffer, _tmLength)) {
+				_tmLost += _tmCount;
+			}
+		}
+	}
+	_tmLength = 0;
+	_tmBlock = 0;
+	_tmCount = 0;
+}
+
+// Describe the telemetry channels on TXS, one reply per channel
+void ArcticTerminal::tmSchema() {
+	size_t count = 0;
+	for (size_t id = 0; id < ARCTIC_TELEMETRY_CHANNELS; id++) {
+		if (_tmChannels[id].type != 0) count++;
+	}
+	txsReply("ARCTIC_COMMAND_REQ_SCHEMA:%u", (unsigned)count);
+	for (size_t id = 0; id < ARCTIC_TELEMETRY_CHANNELS; id++) {
+		const TmChannel& channel = _tmChannels[id];
+		if (channel.type == 0) continue;
+		txsReply("ARCTIC_COMMAND_REQ_CHANNEL:%u,%u,%g,%u,%s", (unsigned)id, channel.type, channel.scale, channel.delta ? 1 : 0, channel.name.c_str());
+	}
+}
+
+// Payload size of a single notification, from the smallest MTU among the subscribed centrals
+size_t ArcticTerminal::txPayload(uint32_t subscribers) {
+	uint16_t mtu = ArcticClient::mtuOf(subscribers);
+	if (mtu <= 3) mtu = BLE_ATT_MTU_DFLT;
+	return std::min((size_t)(mtu - 3), (size_t)ARCTIC_TX_BUFFER_SIZE);
+}
+
+// Deadline timer: Flush output that has waited for the configured latency. The timer task must not
+// block, while a printer holds the TX mutex the timer fires again a tick later.
+void ArcticTerminal::txTimerCallback(TimerHandle_t timer) {
+	ArcticTerminal* console = static_cast<ArcticTerminal*>(pvTimerGetTimerID(timer));
+	if (xSemaphoreTake(console->_txMutex, 0) != pdTRUE) {
+		xTimerChangePeriod(timer, 1, 0);
+		return;
+	}
+	console->txFlush();
+	xSemaphoreGive(console->_txMutex);
+}
+
+// Singlef TX: Single line status, a newer one replaces the pending one and at most one is sent per interval
 void ArcticTerminal::singlef(const char* format, ...) {
-	if (!ArcticClient::arctic_connection_status) return;
+	if (_txsSubscribers.load() == 0) return;
 	if (serviceID == -1) {
 		return;
 	}
-	char buffer[512];
+	char buffer[ARCTIC_TX_BUFFER_SIZE];
 	va_list args;
 	va_start(args, format);
-	vsnprintf(buffer, sizeof(buffer), format, args);
+	int length = vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
+	if (length <= 0) return;
+	if ((size_t)length >= sizeof(buffer)) {
+		length = sizeof(buffer) - 1;
+	}
+
+	xSemaphoreTake(_txMutex, portMAX_DELAY);
+	memcpy(_txsSlot + ARCTIC_TXS_HEADROOM, buffer, length);
+	_txsLength = length;
+	_txsPending = true;
+	unsigned long elapsed = millis() - _txsSent;
+	if (elapsed >= _txsInterval) {
+		txsSend();
+	}
+	if (_txsPending && xTimerIsTimerActive(_txsTimer) == pdFALSE) {
+		uint32_t wait = elapsed < _txsInterval ? _txsInterval - elapsed : 1;
+		xTimerChangePeriod(_txsTimer, pdMS_TO_TICKS(wait) ? pdMS_TO_TICKS(wait) : 1, 0);
+	}
+	xSemaphoreGive(_txMutex);
+}
+
+// Single interval: Min time (ms) between singlef updates, 0 sends every one the link takes
+void ArcticTerminal::singleInterval(uint32_t ms) {
+	_txsInterval = ms;
+}
 
+// Send the pending singlef update, kept pending while the link rejects it
+void ArcticTerminal::txsSend() {
+	if (!_txsPending) return;
+	if (txsWrite(_txsSlot + ARCTIC_TXS_HEADROOM, _txsLength)) {
+		_txsPending = false;
+		_txsSent = millis();
+	}
+}
+
+// Send one message on TXS. Data must have ARCTIC_TXS_HEADROOM bytes before it for the frame headers.
+// False only if nothing was sent, a message cut half way skips a sequence number so the host drops it.
+bool ArcticTerminal::txsWrite(uint8_t* data, size_t length) {
 	auto servicePair = services.find(serviceID);
-	if (servicePair != services.end()) {
-		if (pServer->getConnectedCount() > 0) {
-			NimBLECharacteristic* txsCharacteristic = servicePair->second.txsCharacteristic;
-			if (txsCharacteristic) {
-				txsCharacteristic->setValue((uint8_t*)buffer, strlen(buffer));
-				txsCharacteristic->notify();
-			}
-		}
+	if (servicePair == services.end()) return true;
+	NimBLECharacteristic* txsCharacteristic = servicePair->second.txsCharacteristic;
+	size_t payload = txPayload(_txsSubscribers.load());
+	if (!_txFramed) {
+		return txNotify(txsCharacteristic, data, std::min(length, payload));
 	}
+	if (length > ARCTIC_SEGMENT_MAX) {
+		length = ARCTIC_SEGMENT_MAX;
+	}
+	uint8_t* block = data - ARCTIC_FRAME_HEADER - ARCTIC_SEGMENT_HEADER;
+	size_t total = ARCTIC_FRAME_HEADER + ARCTIC_SEGMENT_HEADER + length;
+	txSegment(block + ARCTIC_FRAME_HEADER, length, false);
+	size_t start = txFrames(txsCharacteristic, block, 0, total, _txsSequence, payload, true);
+	if (start == 0) return false;
+	if (start < total) {
+		_txsSequence++;
+	}
+	return true;
+}
 
+// Reply on TXS right away, for background command answers that must all reach the host.
+// Caller must hold the TX mutex.
+void ArcticTerminal::txsReply(const char* format, ...) {
+	if (_txsSubscribers.load() == 0) return;
+	if (serviceID == -1) {
+		return;
+	}
+	char buffer[ARCTIC_TXS_HEADROOM + ARCTIC_TX_BUFFER_SIZE];
+	uint8_t* block = (uint8_t*)buffer;
+	va_list args;
+	va_start(args, format);
+	va_list attempt;
+	va_copy(attempt, args);
+	int length = vsnprintf(buffer + ARCTIC_TXS_HEADROOM, ARCTIC_TX_BUFFER_SIZE, format, attempt);
+	va_end(attempt);
+	if (length > 0 && (size_t)length >= ARCTIC_TX_BUFFER_SIZE) {
+		block = new (std::nothrow) uint8_t[ARCTIC_TXS_HEADROOM + length + 1];
+		if (block != nullptr) {
+			vsnprintf((char*)block + ARCTIC_TXS_HEADROOM, length + 1, format, args);
+		}
+	}
 	va_end(args);
+
+	if (length > 0 && block != nullptr) {
+		txsWrite(block + ARCTIC_TXS_HEADROOM, length);
+	}
+	if (block != (uint8_t*)buffer) {
+		delete[] block;
+	}
 }
 
-// Updates new data flag
+// Timer callback: Sends the pending singlef update once the interval is over, a tick later while
+// the TX mutex is busy so the timer task never blocks
+void ArcticTerminal::txsTimerCallback(TimerHandle_t timer) {
+	ArcticTerminal* console = static_cast<ArcticTerminal*>(pvTimerGetTimerID(timer));
+	if (xSemaphoreTake(console->_txMutex, 0) != pdTRUE) {
+		xTimerChangePeriod(timer, 1, 0);
+		return;
+	}
+	console->txsSend();
+	if (console->_txsPending) {
+		xTimerChangePeriod(timer, pdMS_TO_TICKS(console->_txsInterval) ? pdMS_TO_TICKS(console->_txsInterval) : 1, 0);
+	}
+	xSemaphoreGive(console->_txMutex);
+}
+
+// Queue a background command for the command timer, a command that doesn't fit is lost
+void ArcticTerminal::cmdQueue(const std::string& command) {
+	uint32_t position;
+	uint8_t* record = _cmdQueue.reserve(command.size(), position);
+	if (record == nullptr) {
+		_rxLost++;
+		return;
+	}
+	memcpy(record, command.data(), command.size());
+	_cmdQueue.commit(position, command.size());
+	xTimerStart(_cmdTimer, 0);
+}
+
+// Command timer: Run the queued background commands, a tick later while the TX mutex is busy
+void ArcticTerminal::cmdTimerCallback(TimerHandle_t timer) {
+	ArcticTerminal* console = static_cast<ArcticTerminal*>(pvTimerGetTimerID(timer));
+	if (xSemaphoreTake(console->_txMutex, 0) != pdTRUE) {
+		xTimerChangePeriod(timer, 1, 0);
+		return;
+	}
+	size_t length;
+	uint32_t token;
+	const uint8_t* record;
+	while ((record = console->_cmdQueue.peek(length, token)) != nullptr) {
+		std::string command((const char*)record, length);
+		console->_cmdQueue.pop(token);
+		console->cmdRun(ArcticCommand(command));
+	}
+	xSemaphoreGive(console->_txMutex);
+}
+
+// Run a background command, caller must hold the TX mutex
+void ArcticTerminal::cmdRun(const ArcticCommand& com) {
+	switch (arctic_hash(com.base())) {
+		case arctic_hash("ARCTIC_COMMAND_GET_NAME"):
+			txsReply("ARCTIC_COMMAND_REQ_NAME:%s", _monitorName.c_str());
+			break;
+		case arctic_hash("ARCTIC_COMMAND_SET_FRAMED"):
+			txSetFramed(com.arg("-e") != "0");
+			break;
+		case arctic_hash("ARCTIC_COMMAND_GET_FORMATS"):
+			logFormats(com.arg("-i"));
+			break;
+		case arctic_hash("ARCTIC_COMMAND_GET_SCHEMA"):
+			tmSchema();
+			break;
+		case arctic_hash("ARCTIC_COMMAND_SET_COMPRESSED"):
+			txSetCompressed(com.arg("-e") != "0");
+			break;
+		case arctic_hash("ARCTIC_COMMAND_SET_TIMESTAMPS"):
+			txSetTimestamps(com.arg("-e") != "0");
+			break;
+	}
+}
+
+// Updates new data: Queues background commands for the command timer, everything else for read().
+// It runs in the BLE host task, which frees the notification buffers a sender may be waiting for,
+// so it never waits on the TX mutex.
 void ArcticTerminal::setNewDataAvailable(bool available, std::string command) {
-	// Process background commands for console
-	ArcticCommand com = ArcticCommand(command);
-	if (com.base() == "ARCTIC_COMMAND_GET_NAME") {
-		singlef("ARCTIC_COMMAND_REQ_NAME:%s", _monitorName.c_str());
-		newDataAvailable = false;
+	// Background commands for console, user data goes to the queue without being parsed
+	if (ArcticCommand::isSystem(command)) {
+		ArcticCommand com(command);
+		switch (arctic_hash(com.base())) {
+			case arctic_hash("ARCTIC_COMMAND_GET_NAME"):
+			case arctic_hash("ARCTIC_COMMAND_SET_FRAMED"):
+			case arctic_hash("ARCTIC_COMMAND_GET_FORMATS"):
+			case arctic_hash("ARCTIC_COMMAND_GET_SCHEMA"):
+			case arctic_hash("ARCTIC_COMMAND_SET_COMPRESSED"):
+			case arctic_hash("ARCTIC_COMMAND_SET_TIMESTAMPS"):
+				cmdQueue(command);
+				return;
+		}
+	}
+	if (!available || command.empty()) return;
+
+	// Queue a copy of the write, the characteristic value may change before it is read
+	uint32_t position;
+	uint8_t* record = _rxQueue.reserve(command.size(), position);
+	if (record == nullptr) {
+		_rxLost++;
 		return;
 	}
-	newDataAvailable = available;
+	memcpy(record, command.data(), command.size());
+	_rxQueue.commit(position, command.size());
+	_rxCount++; // Counted once committed, a reader seeing it can always peek the write
+
+	// Wake the task waiting on this console and the callback task
+	if (_rxSignal != nullptr) {
+		xSemaphoreGive(_rxSignal);
+	}
+	if (ArcticClient::arctic_rx_task != nullptr) {
+		xTaskNotifyGive(ArcticClient::arctic_rx_task);
+	}
 }
 
-// Available RX: Check if new data is available
-bool ArcticTerminal::available() {
-	if (!ArcticClient::arctic_connection_status) return false;
-	bool available = newDataAvailable.load();
-	newDataAvailable = false;
-	return available;
+// Available RX: Number of received writes not read yet
+size_t ArcticTerminal::available() {
+	return _rxCount.load();
 }
 
-// Read RX: Read RX data until delimiter
-std::string ArcticTerminal::read(char delimiter) {
-	if (!ArcticClient::arctic_connection_status) return std::string();
-	auto servicePair = services.find(serviceID);
-	if (servicePair != services.end()) {
-		NimBLECharacteristic* rxCharacteristic = servicePair->second.rxCharacteristic;
-		if (rxCharacteristic) {
-			std::string value = rxCharacteristic->getValue();
-			std::stringstream valueStream(value);
-			std::string line;
-			std::getline(valueStream, line, delimiter);
-			return line;
+// Wait RX: Block until a write is queued or the timeout (ms) expires, false on timeout
+bool ArcticTerminal::wait(uint32_t timeout) {
+	TickType_t start = xTaskGetTickCount();
+	TickType_t ticks = (timeout == ARCTIC_WAIT_FOREVER) ? portMAX_DELAY : pdMS_TO_TICKS(timeout);
+	while (available() == 0) {
+		if (_rxSignal == nullptr) return false;
+		TickType_t elapsed = xTaskGetTickCount() - start;
+		if (ticks != portMAX_DELAY && elapsed >= ticks) return false;
+		// The signal may be left over from a write already read, the queue is checked again
+		xSemaphoreTake(_rxSignal, (ticks == portMAX_DELAY) ? portMAX_DELAY : ticks - elapsed);
+	}
+	return true;
+}
+
+// Command: Register a handler, args describes its keys for help ("-u <ssid> [-t <ms>]"), keys outside
+// brackets are required. Name, args and help must outlive the console, register before reading.
+void ArcticTerminal::command(const char* name, const char* args, const char* help, std::function<void(const ArcticCommand&)> handler) {
+	uint32_t hash = arctic_hash(name);
+	Command* entry = commandFind(name, hash);
+	if (entry != nullptr) {
+		*entry = Command{hash, name, args, help, handler};
+		return;
+	}
+	_commands.push_back(Command{hash, name, args, help, handler});
+
+	// Keep the table at most half full, rebuilt when it grows
+	if (_commands.size() * 2 > _commandSlots.size()) {
+		size_t size = 16;
+		while (size < _commands.size() * 2) {
+			size <<= 1;
+		}
+		_commandSlots.assign(size, 0);
+		for (size_t i = 0; i < _commands.size(); i++) {
+			commandIndex(i);
 		}
+	} else {
+		commandIndex(_commands.size() - 1);
 	}
-	return std::string();
 }
 
-// Read RX: Read raw RX data as vector
-std::vector<uint8_t> ArcticTerminal::raw() {
-	if (!ArcticClient::arctic_connection_status) return std::vector<uint8_t>();
-	auto servicePair = services.find(serviceID);
-	if (servicePair != services.end()) {
-		NimBLECharacteristic* rxCharacteristic = servicePair->second.rxCharacteristic;
-		if (rxCharacteristic) {
-			std::string value = rxCharacteristic->getValue();
-			std::vector<uint8_t> bytes(value.begin(), value.end());
-			return bytes;
+// Dispatch: Run the handler registered for the line, false if there is none. "help" lists the commands.
+bool ArcticTerminal::dispatch(ArcticView line) {
+	ArcticCommand com(line);
+	ArcticView base = com.base();
+	if (base.empty()) return false;
+
+	Command* entry = commandFind(base, arctic_hash(base));
+	if (entry != nullptr) {
+		if (commandUsage(*entry, com)) {
+			entry->handler(com);
+		}
+		return true;
+	}
+	if (base == "help") {
+		// The first word after help, if any, selects one command
+		const char* text = line.begin();
+		while (text < line.end() && isspace((uint8_t)*text)) text++;
+		text += base.size();
+		while (text < line.end() && isspace((uint8_t)*text)) text++;
+		const char* end = text;
+		while (end < line.end() && !isspace((uint8_t)*end)) end++;
+		commandHelp(ArcticView(text, end - text));
+		return true;
+	}
+	return false;
+}
+
+// Command find: Probe from the hash slot, names are compared only when the hash matches
+ArcticTerminal::Command* ArcticTerminal::commandFind(ArcticView name, uint32_t hash) {
+	if (_commandSlots.empty()) return nullptr;
+	size_t mask = _commandSlots.size() - 1;
+	for (size_t slot = hash & mask; _commandSlots[slot] != 0; slot = (slot + 1) & mask) {
+		Command& entry = _commands[_commandSlots[slot] - 1];
+		if (entry.hash == hash && ArcticView(entry.name) == name) {
+			return &entry;
 		}
 	}
-	return std::vector<uint8_t>();
+	return nullptr;
+}
+
+// Command index: Put a command in the first free slot from its hash
+void ArcticTerminal::commandIndex(size_t index) {
+	size_t mask = _commandSlots.size() - 1;
+	size_t slot = _commands[index].hash & mask;
+	while (_commandSlots[slot] != 0) {
+		slot = (slot + 1) & mask;
+	}
+	_commandSlots[slot] = index + 1;
+}
+
+// Check the required keys of the args spec, print the usage if one is missing
+bool ArcticTerminal::commandUsage(const Command& entry, const ArcticCommand& com) {
+	const char* text = entry.args;
+	int depth = 0;
+	while (*text) {
+		if (*text == '[') depth++;
+		if (*text == ']' && depth > 0) depth--;
+		if (*text == '-' && depth == 0 && (text == entry.args || isspace((uint8_t)text[-1]))) {
+			const char* end = text;
+			while (*end && !isspace((uint8_t)*end) && *end != '[' && *end != ']') end++;
+			if (!com.check(ArcticView(text, end - text))) {
+				printf("usage: %s %s\n", entry.name, entry.args);
+				return false;
+			}
+			text = end;
+			continue;
+		}
+		text++;
+	}
+	return true;
+}
+
+// Help: One line per registered command, or only the named one
+void ArcticTerminal::commandHelp(ArcticView name) {
+	bool found = false;
+	for (const Command& entry : _commands) {
+		if (!name.empty() && ArcticView(entry.name) != name) continue;
+		printf("%s%s%s%s%s\n", entry.name, *entry.args ? " " : "", entry.args, *entry.help ? " - " : "", entry.help);
+		found = true;
+	}
+	if (!found && !name.empty()) {
+		printf("Unknown command: %.*s\n", (int)name.size(), name.data());
+	}
+}
+
+// Lost commands: Writes received while the RX queue was full
+uint32_t ArcticTerminal::lostCommands() {
+	return _rxLost.load();
+}
+
+// Pop the write at the head of the RX queue
+void ArcticTerminal::rxPop(uint32_t token) {
+	_rxQueue.pop(token);
+	_rxOffset = 0;
+	_rxCount--;
+}
+
+// Read RX: Oldest received write up to the delimiter, the next lines of a write come in later reads.
+// Waits up to timeout (ms) for a write, an empty string if none arrived.
+std::string ArcticTerminal::read(char delimiter, uint32_t timeout) {
+	if (timeout && !wait(timeout)) return std::string();
+	size_t length;
+	uint32_t token;
+	const uint8_t* record = _rxQueue.peek(length, token);
+	if (record == nullptr) return std::string();
+
+	const char* data = (const char*)record + _rxOffset;
+	size_t remaining = length - _rxOffset;
+	const char* end = (const char*)memchr(data, delimiter, remaining);
+	std::string line(data, end ? end - data : remaining);
+	if (end && end + 1 < data + remaining) {
+		_rxOffset += end + 1 - data;
+	} else {
+		rxPop(token);
+	}
+	return line;
+}
+
+// Raw RX: Unread bytes of the oldest received write
+std::vector<uint8_t> ArcticTerminal::raw() {
+	size_t length;
+	uint32_t token;
+	const uint8_t* record = _rxQueue.peek(length, token);
+	if (record == nullptr) return std::vector<uint8_t>();
+
+	std::vector<uint8_t> bytes(record + _rxOffset, record + length);
+	rxPop(token);
+	return bytes;
 }
 
 void ArcticTerminal::hide() {
-	singlef("ARCTIC_COMMAND_HIDE");
+	if (_txMutex == nullptr) return;
+	xSemaphoreTake(_txMutex, portMAX_DELAY);
+	txsReply("ARCTIC_COMMAND_HIDE");
+	xSemaphoreGive(_txMutex);
 }
 
 void ArcticTerminal::show() {
-	singlef("ARCTIC_COMMAND_SHOW");
+	if (_txMutex == nullptr) return;
+	xSemaphoreTake(_txMutex, portMAX_DELAY);
+	txsReply("ARCTIC_COMMAND_SHOW");
+	xSemaphoreGive(_txMutex);
 }
\ No newline at end of file
@@ -19,16 +19,133 @@
 #pragma once
 
 #include <map>
+#include <new>
 #include <atomic>
 #include <cstdarg>
+#include <functional>
 #include <sstream>
 #include <string>
+#include <type_traits>
 #include <vector>
 #include <Update.h>
 
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/timers.h>
+
 #include <NimBLEDevice.h>
 
+#include <ArcticCommand.h>
 #include <ArcticOTA.h>
+#include <ArcticLZ.h>
+#include <ArcticRing.h>
+
+// TX accumulation buffer, largest ATT payload a notification can carry
+#ifndef ARCTIC_TX_BUFFER_SIZE
+#define ARCTIC_TX_BUFFER_SIZE 512
+#endif
+
+// Per console queue used in async mode
+#ifndef ARCTIC_TX_RING_SIZE
+#define ARCTIC_TX_RING_SIZE 4096
+#endif
+
+// Per console queue of received writes, a write that doesn't fit is lost
+#ifndef ARCTIC_RX_QUEUE_SIZE
+#define ARCTIC_RX_QUEUE_SIZE 1024
+#endif
+
+// Per console queue of background commands, run by a timer so the BLE host task never waits on TX
+#ifndef ARCTIC_CMD_QUEUE_SIZE
+#define ARCTIC_CMD_QUEUE_SIZE 256
+#endif
+
+// Timeout (ms) of wait() and read() that never expires
+#define ARCTIC_WAIT_FOREVER 0xFFFFFFFF
+
+// Framed TX: [sequence][segment length | more][segment data][segment length | more]...
+#define ARCTIC_FRAME_HEADER 1
+#define ARCTIC_SEGMENT_HEADER 2
+#define ARCTIC_SEGMENT_MORE 0x8000
+#define ARCTIC_SEGMENT_MAX 0x7FFF
+
+// Timestamped framed TX: the first segment of a message starts with a zigzag varint us delta
+#define ARCTIC_STAMP_MAX 5
+
+// Smallest input worth compressing in a nearly full TX buffer
+#define ARCTIC_LZ_MIN_ROOM 32
+
+// What printf does when output can't be sent as fast as it is produced
+#define ARCTIC_OVERFLOW_BLOCK 0x00
+#define ARCTIC_OVERFLOW_DROP_NEWEST 0x01
+#define ARCTIC_OVERFLOW_DROP_OLDEST 0x02
+#define ARCTIC_OVERFLOW_SAMPLE 0x03
+
+// Message starts tracked in the TX buffer, for dropping the oldest output
+#ifndef ARCTIC_TX_MARKS
+#define ARCTIC_TX_MARKS 32
+#endif
+
+// Default min time (ms) between singlef updates, about a connection event
+#ifndef ARCTIC_TXS_INTERVAL
+#define ARCTIC_TXS_INTERVAL 20
+#endif
+
+// Room kept before TXS messages for the frame and segment headers
+#define ARCTIC_TXS_HEADROOM (ARCTIC_FRAME_HEADER + ARCTIC_SEGMENT_HEADER)
+
+// Telemetry TX: [sequence][channel][count][value][value]...
+// Delta channels send the first value of a block as is and the rest as zigzag varint differences
+#define ARCTIC_TELEMETRY_BLOCK 2
+#define ARCTIC_TELEMETRY_INT16 0x01
+#define ARCTIC_TELEMETRY_INT32 0x02
+#define ARCTIC_TELEMETRY_FLOAT 0x03
+
+// Telemetry channels per console
+#ifndef ARCTIC_TELEMETRY_CHANNELS
+#define ARCTIC_TELEMETRY_CHANNELS 8
+#endif
+
+// Tokenized log records share the telemetry characteristic: [0xFF][format id][arguments]
+#define ARCTIC_LOG_TAG 0xFF
+
+// Largest encoded arguments of a log record, longer strings are cut. A record also has to fit one
+// telemetry notification, at the default MTU that leaves 14 bytes of arguments.
+#ifndef ARCTIC_LOG_RECORD
+#define ARCTIC_LOG_RECORD 96
+#endif
+
+// Format strings the host can fetch
+#ifndef ARCTIC_LOG_FORMATS
+#define ARCTIC_LOG_FORMATS 128
+#endif
+
+// Default time (ms) buffered output may wait before being flushed
+#ifndef ARCTIC_TX_LATENCY
+#define ARCTIC_TX_LATENCY 20
+#endif
+
+// FNV-1a hash of a format string or command name, evaluated by the compiler in ARCTIC_LOG
+constexpr uint32_t arctic_hash(const char* text, uint32_t hash = 2166136261u) {
+	return *text ? arctic_hash(text + 1, (hash ^ (uint8_t)*text) * 16777619u) : hash;
+}
+
+// Same hash at run time, so received text can be matched against arctic_hash("name") constants
+inline uint32_t arctic_hash(ArcticView text) {
+	uint32_t hash = 2166136261u;
+	for (char c : text) {
+		hash = (hash ^ (uint8_t)c) * 16777619u;
+	}
+	return hash;
+}
+
+// Tokenized log: sends the format id and the raw arguments, the host formats the line.
+// Each call site registers its format once, the host fetches it with ARCTIC_COMMAND_GET_FORMATS.
+#define ARCTIC_LOG(console, format, ...) \
+	do { \
+		static const uint32_t arctic_format_id = ArcticTerminal::registerFormat(std::integral_constant<uint32_t, arctic_hash(format)>::value, format); \
+		(console).log(arctic_format_id, ##__VA_ARGS__); \
+	} while (0)
 
 class ArcticTerminal {
 public:
@@ -37,14 +154,56 @@ public:
 	void start(NimBLEServer* existingServer, NimBLEAdvertising* existingAdvertising);
 	void printf(const char* format, ...);
 	void singlef(const char* format, ...);
-	bool available();
+	void flush();
+	void latency(uint32_t ms);
+	void singleInterval(uint32_t ms);
+	void framed(bool enable);
+	void compressed(bool enable);
+	void timestamps(bool enable);
+	void overflow(uint8_t policy, uint32_t parameter = 0);
+	uint32_t lost();
+	uint32_t lostBytes();
+	uint32_t queued();
+	uint32_t missed();
+	void channel(uint8_t id, const std::string& name, uint8_t type = ARCTIC_TELEMETRY_FLOAT, float scale = 1.0f, bool delta = false);
+	void sample(uint8_t channel, float value);
+	void samples(uint8_t channel, const float* values, size_t count);
+	uint32_t lostSamples();
+	uint32_t lostCommands();
+
+	// Log TX: Binary log record, use ARCTIC_LOG instead of calling it directly.
+	// A record must fit one telemetry notification, strings are cut to the room left.
+	template <typename... Args>
+	void log(uint32_t id, Args... args) {
+		if (_tmSubscribers.load() == 0) return;
+		uint8_t arguments[ARCTIC_LOG_RECORD];
+		size_t length = 0;
+		size_t limit = logRoom();
+		logEncode(arguments, length, limit, args...);
+		if (length > limit) {
+			_tmLost++;
+			return;
+		}
+		logRecord(id, arguments, length);
+	}
+	static uint32_t registerFormat(uint32_t id, const char* format);
+	size_t available();
+	bool wait(uint32_t timeout = ARCTIC_WAIT_FOREVER);
+	void command(const char* name, const char* args, const char* help, std::function<void(const ArcticCommand&)> handler);
+	bool dispatch(ArcticView line);
 	void hide();
 	void show();
-	std::string read(char delimiter = '\n');
+	std::string read(char delimiter = '\n', uint32_t timeout = 0);
 	std::vector<uint8_t> raw();
 
 	int createService(NimBLEAdvertising* existingAdvertising);
 	void setNewDataAvailable(bool available, std::string command);
+	void setTxStatus(int code);
+	void subscribe(NimBLECharacteristic* characteristic, uint16_t handle, bool enable);
+	void unsubscribe(uint16_t handle);
+	bool subscribed();
+	void async(size_t capacity);
+	uint32_t drain();
 
 private:
 	bool _debug_enabled = false;
@@ -53,6 +212,7 @@ private:
 		NimBLECharacteristic* txCharacteristic;
 		NimBLECharacteristic* txsCharacteristic;
 		NimBLECharacteristic* rxCharacteristic;
+		NimBLECharacteristic* tmCharacteristic;
 	};
 
 	std::string _monitorName;
@@ -62,6 +222,198 @@ private:
 	NimBLEServer* pServer;
 	NimBLEService* pService;
 
-	std::atomic<bool> newDataAvailable{false};
 	std::map<int, ServiceCharacteristics> services;
+
+	// Centrals subscribed to TX, TXS and telemetry, one bit per ArcticClient::arctic_connections slot.
+	// Output nobody subscribed to is dropped before it is formatted.
+	std::atomic<uint32_t> _txSubscribers{0};
+	std::atomic<uint32_t> _txsSubscribers{0};
+	std::atomic<uint32_t> _tmSubscribers{0};
+
+	// RX queue, filled by the RX callback and read by a single task. A write holding several
+	// lines stays at the head until all of them are read, _rxOffset is where the next one starts.
+	ArcticRing _rxQueue{ARCTIC_RX_QUEUE_SIZE};
+	std::atomic<size_t> _rxCount{0};
+	std::atomic<uint32_t> _rxLost{0};
+	size_t _rxOffset = 0;
+	SemaphoreHandle_t _rxSignal = nullptr;
+
+	// Background commands received, run under the TX mutex by the command timer
+	ArcticRing _cmdQueue{ARCTIC_CMD_QUEUE_SIZE};
+	TimerHandle_t _cmdTimer = nullptr;
+
+	// Command registry, found by name hash in an open addressing table of indexes + 1 (0 is free)
+	struct Command {
+		uint32_t hash;
+		const char* name;
+		const char* args;
+		const char* help;
+		std::function<void(const ArcticCommand&)> handler;
+	};
+
+	std::vector<Command> _commands;
+	std::vector<uint16_t> _commandSlots;
+
+	// TX accumulation buffer, holds the notification being filled from _txStart
+	struct TxMark {
+		uint16_t offset;
+		uint16_t count;
+		uint32_t stamp;
+	};
+
+	uint8_t _txBuffer[ARCTIC_TX_BUFFER_SIZE];
+	size_t _txStart = 0;
+	size_t _txLength = 0;
+	size_t _txPayload = 0;
+	uint32_t _txLatency = ARCTIC_TX_LATENCY;
+	bool _txFramed = false;
+	uint8_t _txSequence = 0;
+	uint8_t _txsSequence = 0;
+	bool _txCompressed = false;
+	bool _txRestart = false;
+	bool _txTimestamps = false;
+	uint32_t _txStamp = 0;
+	ArcticLZEncoder* _txEncoder = nullptr;
+	TxMark _txMarks[ARCTIC_TX_MARKS];
+	size_t _txMarkCount = 0;
+	SemaphoreHandle_t _txMutex = nullptr;
+	TimerHandle_t _txTimer = nullptr;
+
+	// Latest singlef update, replaced until it is sent
+	uint8_t _txsSlot[ARCTIC_TXS_HEADROOM + ARCTIC_TX_BUFFER_SIZE];
+	size_t _txsLength = 0;
+	bool _txsPending = false;
+	uint32_t _txsInterval = ARCTIC_TXS_INTERVAL;
+	unsigned long _txsSent = 0;
+	TimerHandle_t _txsTimer = nullptr;
+
+	// Congestion handling and drop accounting
+	int _txFailures = 0; // Subscribers the last notify failed for
+	bool _txCongested = false;
+	uint8_t _txPolicy = ARCTIC_OVERFLOW_DROP_NEWEST;
+	uint32_t _txPolicyParameter = 0;
+	std::atomic<uint32_t> _txSampled{0};
+	std::atomic<uint32_t> _lostMessages{0};
+	std::atomic<uint32_t> _lostBytes{0};
+	std::atomic<uint32_t> _txMissed{0};
+	std::atomic<uint32_t> _lostReported{0};
+	std::atomic<uint32_t> _lostReportedBytes{0};
+
+	// Async mode queue, filled by any task and drained by the ArcticClient TX task
+	ArcticRing* _txRing = nullptr;
+	std::atomic<size_t> _txQueued{0};
+	unsigned long _txSince = 0;
+
+	// Telemetry buffer, one block per run of samples of the same channel
+	struct TmChannel {
+		std::string name;
+		uint8_t type = 0;
+		float scale = 1.0f;
+		bool delta = false;
+	};
+
+	TmChannel _tmChannels[ARCTIC_TELEMETRY_CHANNELS];
+	uint8_t _tmBuffer[ARCTIC_TX_BUFFER_SIZE];
+	size_t _tmLength = 0;
+	size_t _tmPayload = 0;
+	size_t _tmBlock = 0;
+	size_t _tmCount = 0;
+	int32_t _tmLast = 0;
+	uint8_t _tmSequence = 0;
+	unsigned long _tmSince = 0;
+	std::atomic<uint32_t> _tmLost{0};
+
+	// Format strings seen by ARCTIC_LOG, shared by all consoles
+	static const char* _logFormats[ARCTIC_LOG_FORMATS];
+	static std::atomic<uint32_t> _logIds[ARCTIC_LOG_FORMATS];
+	static std::atomic<size_t> _logFormatCount;
+
+	// Arguments: integers as zigzag varints, floating point as float, strings as length and bytes.
+	// An argument past limit leaves length over it and log() drops the record.
+	static void logEncode(uint8_t* record, size_t& length, size_t limit) {
+	}
+	template <typename T, typename... Args>
+	static void logEncode(uint8_t* record, size_t& length, size_t limit, T value, Args... args) {
+		logArgument(record, length, limit, value);
+		logEncode(record, length, limit, args...);
+	}
+	template <typename T>
+	static typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type logArgument(uint8_t* record, size_t& length, size_t limit, T value) {
+		logInteger(record, length, limit, (int64_t)value);
+	}
+	template <typename T>
+	static typename std::enable_if<std::is_floating_point<T>::value>::type logArgument(uint8_t* record, size_t& length, size_t limit, T value) {
+		logFloat(record, length, limit, (float)value);
+	}
+	template <typename T>
+	static typename std::enable_if<std::is_pointer<T>::value>::type logArgument(uint8_t* record, size_t& length, size_t limit, T value) {
+		logPointer(record, length, limit, value);
+	}
+	static void logPointer(uint8_t* record, size_t& length, size_t limit, const char* value) {
+		logString(record, length, limit, value);
+	}
+	static void logPointer(uint8_t* record, size_t& length, size_t limit, const void* value) {
+		logInteger(record, length, limit, (int64_t)(uintptr_t)value);
+	}
+	static void logInteger(uint8_t* record, size_t& length, size_t limit, int64_t value);
+	static void logFloat(uint8_t* record, size_t& length, size_t limit, float value);
+	static void logString(uint8_t* record, size_t& length, size_t limit, const char* value);
+	size_t logRoom();
+	void logRecord(uint32_t id, const uint8_t* arguments, size_t length);
+	void logFormats(const std::string& filter);
+
+	void rxPop(uint32_t token);
+	void cmdQueue(const std::string& command);
+	void cmdRun(const ArcticCommand& com);
+	static void cmdTimerCallback(TimerHandle_t timer);
+	Command* commandFind(ArcticView name, uint32_t hash);
+	void commandIndex(size_t index);
+	bool commandUsage(const Command& entry, const ArcticCommand& com);
+	void commandHelp(ArcticView name);
+
+	void tmAppend(uint8_t channel, float value);
+	void tmSchedule(size_t added);
+	void tmSend();
+	void tmSchema();
+
+	void txPrint(const char* format, va_list args);
+	bool txFormat(const char* format, va_list args, uint32_t stamp);
+	bool txFormatCompressed(const char* format, va_list args);
+	bool txCompress(const uint8_t* data, size_t length);
+	void txSchedule();
+	bool txLong(const char* format, va_list args, size_t length, uint32_t stamp);
+	void txEnqueue(const char* format, va_list args);
+	void txQueued(size_t length);
+	bool txDropOldest();
+	void txCollect();
+	bool txAppend(const uint8_t* data, size_t length, uint32_t stamp, bool marker = false);
+	void txReport();
+	void txLost(uint32_t messages, size_t bytes);
+	void txLose(const char* format, va_list args);
+	void txDiscard();
+	void txMark(size_t offset, uint16_t count, uint32_t stamp);
+	size_t txStamp(uint32_t stamp, uint8_t* out);
+	size_t txStampRead(const uint8_t* data, int32_t& delta);
+	void txPush();
+	void txSend();
+	void txFlush();
+	void txArm();
+	void txSetFramed(bool enable);
+	void txSetCompressed(bool enable);
+	void txSetTimestamps(bool enable);
+	bool txRestart();
+	void txSent(size_t start);
+	void txCompact();
+	void txOpen();
+	bool txEmpty();
+	void txSegment(uint8_t* header, size_t length, bool more);
+	size_t txFrames(NimBLECharacteristic* characteristic, uint8_t* buffer, size_t start, size_t length, uint8_t& sequence, size_t payload, bool final);
+	bool txNotify(NimBLECharacteristic* characteristic, const uint8_t* data, size_t length);
+	std::atomic<uint32_t>* txSubscribers(NimBLECharacteristic* characteristic);
+	size_t txPayload(uint32_t subscribers);
+	static void txTimerCallback(TimerHandle_t timer);
+	void txsSend();
+	bool txsWrite(uint8_t* data, size_t length);
+	void txsReply(const char* format, ...);
+	static void txsTimerCallback(TimerHandle_t timer);
 };
\ No newline at end of file